@@ -0,0 +1,449 @@
+#include <poll.h>
+#include <pthread.h>
+
+#include "utils.h"
+#include "autoflush.h"
+
+/* A stream busy in another thread is tried again this soon (at most): */
+#define AUTOFLUSH_RETRY_NS 100000ULL
+
+/* How the timer thread flushes a stream without waiting for its fd: */
+enum {
+	AF_PLAIN, /* regular file or block device: writes do not wait */
+	AF_NONBLOCK, /* write-only: O_NONBLOCK is set for the flush */
+	AF_POLL, /* also read: flushed only once poll reports POLLOUT */
+};
+
+/*
+ * Structure for the autoflush state of a stream. deadline is set, under
+ lock, when the write buffer stops being empty and cleared when it is
+ flushed; the timer thread reads it without the lock (atomically). A
+ stream with a deadline is in the heap of the timer, keyed by a time not
+ later than it; the entry of a cleared deadline is dropped when it is due.
+ */
+struct autoflush {
+	pthread_mutex_t lock; /* taken by every call that uses wbuffer */
+	SO_FILE *stream;
+	size_t bytes; /* flush once this many bytes are buffered */
+	unsigned long long latency_ns; /* 0 for no latency bound */
+	unsigned long long deadline; /* 0 while nothing is buffered */
+	unsigned long long key; /* when the timer looks at it again */
+	long index; /* position in the heap, -1 if not there */
+	int mode; /* AF_PLAIN, AF_NONBLOCK or AF_POLL */
+};
+
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_cond; /* a deadline earlier than timer_wake */
+static pthread_cond_t flushed_cond; /* the timer finished a flush */
+static pthread_once_t timer_once = PTHREAD_ONCE_INIT;
+static int timer_started;
+
+/* Min-heap of the streams with a deadline, by key: */
+static struct autoflush **heap;
+static size_t heap_len;
+static size_t heap_cap; /* at least the number of streams with a bound */
+static size_t timed; /* streams with a latency bound */
+
+static struct autoflush *flushing; /* stream flushed by the timer */
+static unsigned long long timer_wake = ULLONG_MAX; /* timer sleeps until */
+
+static void timer_start(void);
+
+/*
+ * Description: heap helpers, called with the timer lock held. heap_set
+ puts af at position i; heap_fix moves it up or down to its place.
+ */
+static void heap_set(size_t i, struct autoflush *af)
+{
+	heap[i] = af;
+	af->index = i;
+}
+
+static void heap_fix(struct autoflush *af)
+{
+	size_t i = af->index, child;
+
+	while (i > 0 && af->key < heap[(i - 1) / 2]->key) {
+		heap_set(i, heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= heap_len)
+			break;
+		if (child + 1 < heap_len &&
+		    heap[child + 1]->key < heap[child]->key)
+			child++;
+		if (heap[child]->key >= af->key)
+			break;
+		heap_set(i, heap[child]);
+		i = child;
+	}
+
+	heap_set(i, af);
+}
+
+static void heap_push(struct autoflush *af, unsigned long long key)
+{
+	af->key = key;
+	af->index = heap_len++;
+	heap_fix(af);
+}
+
+static void heap_remove(struct autoflush *af)
+{
+	struct autoflush *last = heap[--heap_len];
+
+	if (last != af) {
+		last->index = af->index;
+		heap_fix(last);
+	}
+	af->index = -1;
+}
+
+static void heap_rekey(struct autoflush *af, unsigned long long key)
+{
+	af->key = key;
+	heap_fix(af);
+}
+
+/*
+ * Description: takes the stream lock, if the stream has autoflush set.
+ */
+void autoflush_lock(SO_FILE *stream)
+{
+	if (stream->autoflush != NULL)
+		pthread_mutex_lock(&stream->autoflush->lock);
+}
+
+/*
+ * Description: flushes the write buffer if it holds enough bytes, arms
+ the deadline of its oldest byte for the timer, then releases the stream
+ lock. A failed flush sets the error flag of the stream.
+ */
+void autoflush_unlock(SO_FILE *stream)
+{
+	struct autoflush *af = stream->autoflush;
+	unsigned long long deadline;
+
+	if (af == NULL)
+		return;
+
+	if (stream->woffset != 0 && (size_t) stream->woffset >= af->bytes)
+		unload_wbuffer(stream);
+
+	if (stream->woffset == 0) {
+		__atomic_store_n(&af->deadline, 0, __ATOMIC_RELAXED);
+	} else if (af->deadline == 0 && af->latency_ns != 0) {
+		/* The timer thread of a forked parent is not in the child: */
+		if (!timer_started)
+			pthread_once(&timer_once, timer_start);
+		deadline = now_ns() + af->latency_ns;
+		pthread_mutex_lock(&timer_lock);
+		__atomic_store_n(&af->deadline, deadline, __ATOMIC_RELAXED);
+		if (af->index < 0)
+			heap_push(af, deadline);
+		else if (deadline < af->key)
+			heap_rekey(af, deadline);
+		if (deadline < timer_wake)
+			pthread_cond_signal(&timer_cond);
+		pthread_mutex_unlock(&timer_lock);
+	}
+
+	pthread_mutex_unlock(&af->lock);
+}
+
+/*
+ * Description: flushes the write buffer without waiting for the fd: what
+ does not fit stays buffered (see wbuffer_unloaded).
+ */
+static void flush_nowait(struct autoflush *af)
+{
+	SO_FILE *stream = af->stream;
+	struct pollfd pfd = { .fd = stream->fd, .events = POLLOUT };
+	int flags;
+
+	if (af->mode == AF_PLAIN || stream->nonblock) {
+		unload_wbuffer(stream);
+		return;
+	}
+
+	if (af->mode == AF_POLL) {
+		if (poll(&pfd, 1, 0) == 1)
+			unload_wbuffer(stream);
+		return;
+	}
+
+	flags = fcntl(stream->fd, F_GETFL);
+	if (flags < 0 || fcntl(stream->fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return;
+	stream->nonblock = 1;
+	unload_wbuffer(stream);
+	stream->nonblock = 0;
+	fcntl(stream->fd, F_SETFL, flags);
+}
+
+/*
+ * Description: flushes a stream whose deadline passed, called with the
+ timer lock held. The timer lock is released meanwhile; flushing keeps
+ the stream from being freed until it is done. A stream locked by another
+ thread (which may be blocked in a write) is not waited for, but tried
+ again shortly, and a slow fd gets only what it takes right away, so one
+ stream cannot hold back the deadlines of the others.
+ */
+static void timer_flush(struct autoflush *af, unsigned long long now)
+{
+	SO_FILE *stream = af->stream;
+	unsigned long long deadline, retry;
+
+	flushing = af;
+	pthread_mutex_unlock(&timer_lock);
+
+	retry = af->latency_ns < AUTOFLUSH_RETRY_NS ? af->latency_ns :
+						      AUTOFLUSH_RETRY_NS;
+	if (pthread_mutex_trylock(&af->lock) == 0) {
+		retry = 0;
+		if (af->deadline != 0 && af->deadline <= now) {
+			flush_nowait(af);
+
+			/* Bytes left (EAGAIN) get another period: */
+			deadline = stream->woffset != 0 ?
+				   now_ns() + af->latency_ns : 0;
+			__atomic_store_n(&af->deadline, deadline,
+					 __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&af->lock);
+	}
+
+	pthread_mutex_lock(&timer_lock);
+	/* Not removed by autoflush_free meanwhile: */
+	if (af->index >= 0) {
+		deadline = __atomic_load_n(&af->deadline, __ATOMIC_RELAXED);
+		if (deadline == 0)
+			heap_remove(af);
+		else
+			heap_rekey(af, retry != 0 ? now + retry : deadline);
+	}
+	flushing = NULL;
+	pthread_cond_broadcast(&flushed_cond);
+}
+
+/*
+ * Description: timer thread: takes the streams off the top of the heap
+ while they are due, and sleeps until the next one.
+ */
+static void *timer_thread(void *arg)
+{
+	unsigned long long now, next, deadline;
+	struct autoflush *af;
+	struct timespec ts;
+
+	pthread_mutex_lock(&timer_lock);
+	for (;;) {
+		now = now_ns();
+		if (heap_len != 0 && heap[0]->key <= now) {
+			af = heap[0];
+			deadline = __atomic_load_n(&af->deadline,
+						   __ATOMIC_RELAXED);
+			if (deadline == 0)
+				heap_remove(af);
+			else if (deadline > now)
+				heap_rekey(af, deadline);
+			else
+				timer_flush(af, now);
+			continue;
+		}
+
+		next = heap_len != 0 ? heap[0]->key : ULLONG_MAX;
+		timer_wake = next;
+		if (next == ULLONG_MAX) {
+			pthread_cond_wait(&timer_cond, &timer_lock);
+		} else {
+			ts.tv_sec = next / 1000000000ULL;
+			ts.tv_nsec = next % 1000000000ULL;
+			pthread_cond_timedwait(&timer_cond, &timer_lock, &ts);
+		}
+		timer_wake = 0;
+	}
+
+	return NULL;
+}
+
+/*
+ * Description: starts the timer thread, once per process. Its condition
+ uses CLOCK_MONOTONIC, like now_ns.
+ */
+static void timer_start(void)
+{
+	pthread_condattr_t cattr;
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&timer_cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+	pthread_cond_init(&flushed_cond, NULL);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, timer_thread, NULL) == 0)
+		timer_started = 1;
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * Description: fork handlers, called by those of the registry. The timer
+ lock is held across fork; the child gets no timer thread, so it is
+ started again when a deadline is next armed.
+ */
+void autoflush_fork_prepare(void)
+{
+	pthread_mutex_lock(&timer_lock);
+}
+
+void autoflush_fork_parent(void)
+{
+	pthread_mutex_unlock(&timer_lock);
+}
+
+void autoflush_fork_child(void)
+{
+	static const pthread_once_t once_init = PTHREAD_ONCE_INIT;
+
+	pthread_mutex_init(&timer_lock, NULL);
+	timer_once = once_init;
+	timer_started = 0;
+	flushing = NULL;
+	timer_wake = ULLONG_MAX;
+}
+
+/*
+ * Description: resets the stream lock in a forked child, where the thread
+ that may have held it does not exist.
+ */
+void autoflush_forked(SO_FILE *stream)
+{
+	struct autoflush *af = stream->autoflush;
+
+	if (af == NULL)
+		return;
+
+	pthread_mutex_init(&af->lock, NULL);
+	af->deadline = 0;
+}
+
+/*
+ * Description: stops autoflush for a stream. Once this returns, the timer
+ thread does not touch it any more.
+ */
+void autoflush_free(SO_FILE *stream)
+{
+	struct autoflush *af = stream->autoflush;
+
+	if (af == NULL)
+		return;
+
+	if (af->latency_ns != 0) {
+		pthread_mutex_lock(&timer_lock);
+		if (af->index >= 0)
+			heap_remove(af);
+		timed--;
+		while (flushing == af)
+			pthread_cond_wait(&flushed_cond, &timer_lock);
+		pthread_mutex_unlock(&timer_lock);
+	}
+
+	pthread_mutex_destroy(&af->lock);
+	free(af);
+	stream->autoflush = NULL;
+	stream->wlimit = stream->wbuffer != NULL ? stream->bufsize : 0;
+}
+
+/*
+ * Description: coalesces writes: the write buffer is flushed when it is
+ full, when bytes are buffered (0: only when full) or when the oldest
+ buffered byte is usec microseconds old (0: no latency bound), whichever
+ comes first. Meant for pipes and record-oriented output, where a flush
+ per record costs a syscall each and a full buffer may wait too long.
+ Latency bounds are kept by a timer thread shared by all streams, which
+ flushes concurrently with the caller, so the calls touching the write
+ buffer are serialized by a per-stream lock (so_putc always calls
+ so_fputc); so_wbuffer_prepare/so_wbuffer_commit must not be used. The
+ timer does not wait for a slow fd: it writes what fits and leaves the
+ rest for the next period. Pool streams, whose frames cannot be cut, take
+ no latency bound. Both 0 turn autoflush off.
+ * Return: 0/SO_EOF if fails.
+ */
+int so_fsetautoflush(SO_FILE *stream, size_t bytes, unsigned int usec)
+{
+	struct autoflush *af, **grown;
+	struct stat st;
+	size_t cap;
+	int flags;
+
+	if (stream->direct || (usec != 0 && stream->pool != NULL)) {
+		errno = EINVAL;
+		return SO_EOF;
+	}
+
+	autoflush_free(stream);
+	if (bytes == 0 && usec == 0)
+		return 0;
+
+	af = calloc(1, sizeof(*af));
+	if (af == NULL)
+		return SO_EOF;
+	af->stream = stream;
+	af->bytes = bytes != 0 ? bytes : SIZE_MAX;
+	af->latency_ns = usec * 1000ULL;
+	af->index = -1;
+
+	if (af->latency_ns != 0) {
+		flags = fcntl(stream->fd, F_GETFL);
+		if (flags < 0 || fstat(stream->fd, &st) < 0)
+			goto fail;
+		if (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))
+			af->mode = AF_PLAIN;
+		else if ((flags & O_ACCMODE) == O_WRONLY)
+			af->mode = AF_NONBLOCK;
+		else
+			af->mode = AF_POLL;
+
+		pthread_once(&timer_once, timer_start);
+		if (!timer_started) {
+			errno = EAGAIN;
+			goto fail;
+		}
+
+		/* Room in the heap for every stream, so arming never fails: */
+		pthread_mutex_lock(&timer_lock);
+		if (timed == heap_cap) {
+			cap = heap_cap != 0 ? 2 * heap_cap : 64;
+			grown = realloc(heap, cap * sizeof(*heap));
+			if (grown == NULL) {
+				pthread_mutex_unlock(&timer_lock);
+				goto fail;
+			}
+			heap = grown;
+			heap_cap = cap;
+		}
+		timed++;
+		pthread_mutex_unlock(&timer_lock);
+	}
+
+	pthread_mutex_init(&af->lock, NULL);
+	stream->autoflush = af;
+	stream->wlimit = 0;
+
+	/* Bytes already buffered wait at most one period: */
+	pthread_mutex_lock(&af->lock);
+	autoflush_unlock(stream);
+
+	return 0;
+
+fail:
+	free(af);
+	return SO_EOF;
+}
@@ -0,0 +1,21 @@
+#ifndef AUTOFLUSH_H
+#define AUTOFLUSH_H
+
+#include "so_file.h"
+
+/*
+ * Write coalescing (so_fsetautoflush). A shared timer thread flushes the
+ stream once its oldest buffered byte is old enough, so the calls that
+ touch the write buffer run between autoflush_lock and autoflush_unlock.
+ */
+
+void autoflush_lock(SO_FILE *stream);
+void autoflush_unlock(SO_FILE *stream);
+void autoflush_free(SO_FILE *stream);
+
+void autoflush_fork_prepare(void);
+void autoflush_fork_parent(void);
+void autoflush_fork_child(void);
+void autoflush_forked(SO_FILE *stream);
+
+#endif
@@ -0,0 +1,403 @@
+/*
+ * Benchmark comparing so_stdio against glibc stdio.
+ *
+ * Every workload is run for both libraries, in every directory given with
+ * -d (default: /dev/shm and the current directory) and with every buffer
+ * size given with -b. Results are printed as CSV:
+ *
+ *   lib,workload,dir,bufsize,bytes,seconds,mb_per_s,syscalls
+ *
+ * syscalls is the number of read and write calls the process made during
+ * the run, taken from /proc/self/io (-1 if not available); lseek calls
+ * are not included.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "so_stdio.h"
+
+#define MAX_DIRS 8
+#define MAX_BUFSIZES 16
+#define SMALL_ELEM 16 /* element size for small so_fread/so_fwrite */
+#define LARGE_ELEM (1 << 20) /* element size for large so_fread/so_fwrite */
+#define LINE_LEN 80 /* average length of a line */
+#define SEEK_READ 64 /* bytes read after each random seek */
+#define SEEKS 20000
+#define POPENS 200
+
+/*
+ * Structure for the result of a workload run.
+ */
+struct result {
+	long long bytes; /* bytes moved */
+	double seconds;
+	long long syscalls;
+};
+
+static FILE *out;
+static size_t file_size = 16 << 20;
+static char *chunk; /* LARGE_ELEM bytes of data */
+
+/*
+ * Description: number of read and write syscalls done by the process.
+ * Return: count/-1 if /proc/self/io is not available.
+ */
+static long long syscall_count(void)
+{
+	char buf[512], *p;
+	long long syscr, syscw;
+	int fd, len;
+
+	fd = open("/proc/self/io", O_RDONLY);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	buf[len] = '\0';
+
+	p = strstr(buf, "syscr:");
+	if (p == NULL || sscanf(p, "syscr: %lld", &syscr) != 1)
+		return -1;
+	p = strstr(buf, "syscw:");
+	if (p == NULL || sscanf(p, "syscw: %lld", &syscw) != 1)
+		return -1;
+
+	return syscr + syscw;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * The workloads are written once and instantiated for both libraries, so
+ * that every call is a direct one, as it would be in a real program.
+ */
+#define DEFINE_WORKLOADS(lib, FTYPE, OPEN, CLOSE, GETC, PUTC, READ, WRITE,   \
+			 SEEK, POPEN, PCLOSE)				     \
+									     \
+static long long lib##_write_putc(const char *path, size_t bufsize)	     \
+{									     \
+	FTYPE *f = OPEN(path, "w", bufsize);				     \
+	size_t i;							     \
+									     \
+	for (i = 0; i < file_size; i++)					     \
+		PUTC(i % LINE_LEN == LINE_LEN - 1 ? '\n' : 'a' + i % 26, f); \
+	CLOSE(f);							     \
+	return file_size;						     \
+}									     \
+									     \
+static long long lib##_write_elems(const char *path, size_t bufsize,	     \
+				   size_t elem)				     \
+{									     \
+	FTYPE *f = OPEN(path, "w", bufsize);				     \
+	size_t i;							     \
+									     \
+	for (i = 0; i + elem <= file_size; i += elem)			     \
+		WRITE(chunk + i % LARGE_ELEM, elem, 1, f);		     \
+	CLOSE(f);							     \
+	return i;							     \
+}									     \
+									     \
+static long long lib##_write_small(const char *path, size_t bufsize)	     \
+{									     \
+	return lib##_write_elems(path, bufsize, SMALL_ELEM);		     \
+}									     \
+									     \
+static long long lib##_write_large(const char *path, size_t bufsize)	     \
+{									     \
+	return lib##_write_elems(path, bufsize, LARGE_ELEM);		     \
+}									     \
+									     \
+static long long lib##_read_getc(const char *path, size_t bufsize)	     \
+{									     \
+	FTYPE *f = OPEN(path, "r", bufsize);				     \
+	long long n = 0;						     \
+									     \
+	while (GETC(f) != EOF)						     \
+		n++;							     \
+	CLOSE(f);							     \
+	return n;							     \
+}									     \
+									     \
+static long long lib##_read_elems(const char *path, size_t bufsize,	     \
+				  size_t elem)				     \
+{									     \
+	FTYPE *f = OPEN(path, "r", bufsize);				     \
+	long long n = 0;						     \
+									     \
+	while (READ(chunk, elem, 1, f) == 1)				     \
+		n += elem;						     \
+	CLOSE(f);							     \
+	return n;							     \
+}									     \
+									     \
+static long long lib##_read_small(const char *path, size_t bufsize)	     \
+{									     \
+	return lib##_read_elems(path, bufsize, SMALL_ELEM);		     \
+}									     \
+									     \
+static long long lib##_read_large(const char *path, size_t bufsize)	     \
+{									     \
+	return lib##_read_elems(path, bufsize, LARGE_ELEM);		     \
+}									     \
+									     \
+static long long lib##_read_lines(const char *path, size_t bufsize)	     \
+{									     \
+	FTYPE *f = OPEN(path, "r", bufsize);				     \
+	char line[4 * LINE_LEN];					     \
+	long long n = 0;						     \
+	int c, len = 0;							     \
+									     \
+	while ((c = GETC(f)) != EOF) {					     \
+		if (len < (int) sizeof(line))				     \
+			line[len++] = c;				     \
+		if (c == '\n') {					     \
+			n += len;					     \
+			len = 0;					     \
+		}							     \
+	}								     \
+	CLOSE(f);							     \
+	return n + len;							     \
+}									     \
+									     \
+static long long lib##_seek_read(const char *path, size_t bufsize)	     \
+{									     \
+	FTYPE *f = OPEN(path, "r", bufsize);				     \
+	long long n = 0;						     \
+	int i;								     \
+									     \
+	srand(42);							     \
+	for (i = 0; i < SEEKS; i++) {					     \
+		SEEK(f, rand() % (file_size - SEEK_READ), SEEK_SET);	     \
+		n += READ(chunk, 1, SEEK_READ, f);			     \
+	}								     \
+	CLOSE(f);							     \
+	return n;							     \
+}									     \
+									     \
+static long long lib##_popen_rt(const char *path, size_t bufsize)	     \
+{									     \
+	long long n = 0;						     \
+	FTYPE *f;							     \
+	int i;								     \
+									     \
+	for (i = 0; i < POPENS; i++) {					     \
+		f = POPEN("echo round-trip", "r");			     \
+		if (f == NULL) {					     \
+			perror("popen");				     \
+			exit(EXIT_FAILURE);				     \
+		}							     \
+		while (GETC(f) != EOF)					     \
+			n++;						     \
+		PCLOSE(f);						     \
+	}								     \
+	return n;							     \
+}
+
+/*
+ * Description: opens a so_stdio stream with the given buffer size.
+ */
+static SO_FILE *so_open(const char *path, const char *mode, size_t bufsize)
+{
+	SO_FILE *f = so_fopen(path, mode);
+
+	if (f == NULL) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	if (so_setvbuf(f, bufsize) != 0) {
+		perror("so_setvbuf");
+		exit(EXIT_FAILURE);
+	}
+
+	return f;
+}
+
+/*
+ * Description: opens a glibc stream with the given buffer size. glibc
+ ignores the size unless it is given the buffer, so the buffer is
+ allocated here and freed by libc_close (one stream is open at a time).
+ */
+static char *libc_buf;
+
+static FILE *libc_open(const char *path, const char *mode, size_t bufsize)
+{
+	FILE *f = fopen(path, mode);
+
+	libc_buf = malloc(bufsize);
+	if (f == NULL || libc_buf == NULL) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	if (setvbuf(f, libc_buf, _IOFBF, bufsize) != 0) {
+		perror("setvbuf");
+		exit(EXIT_FAILURE);
+	}
+
+	return f;
+}
+
+static int libc_close(FILE *f)
+{
+	int rc = fclose(f);
+
+	free(libc_buf);
+	libc_buf = NULL;
+
+	return rc;
+}
+
+DEFINE_WORKLOADS(so, SO_FILE, so_open, so_fclose, so_getc, so_putc,
+		 so_fread, so_fwrite, so_fseek, so_popen, so_pclose)
+DEFINE_WORKLOADS(libc, FILE, libc_open, libc_close, getc, putc,
+		 fread, fwrite, fseek, popen, pclose)
+
+/*
+ * Structure for a workload. All of them use the same file: writers
+ recreate it (write_putc last, so readers get lines) and readers read it.
+ */
+struct workload {
+	const char *name;
+	long long (*run[2])(const char *path, size_t bufsize);
+	int once; /* does not depend on the buffer size */
+};
+
+static const char * const libs[2] = { "so_stdio", "glibc" };
+
+#define WORKLOAD(name, once) { #name, { so_##name, libc_##name }, once }
+
+static const struct workload workloads[] = {
+	WORKLOAD(write_small, 0),
+	WORKLOAD(write_large, 0),
+	WORKLOAD(write_putc, 0),
+	WORKLOAD(read_getc, 0),
+	WORKLOAD(read_small, 0),
+	WORKLOAD(read_large, 0),
+	WORKLOAD(read_lines, 0),
+	WORKLOAD(seek_read, 0),
+	WORKLOAD(popen_rt, 1),
+};
+
+/*
+ * Description: runs a workload and prints its result.
+ */
+static void run(const struct workload *w, int lib, const char *dir,
+		const char *path, size_t bufsize)
+{
+	struct result r;
+	long long calls;
+	double start;
+
+	calls = syscall_count();
+	start = now();
+	r.bytes = w->run[lib](path, bufsize);
+	r.seconds = now() - start;
+	r.syscalls = calls < 0 ? -1 : syscall_count() - calls;
+
+	fprintf(out, "%s,%s,%s,%zu,%lld,%.6f,%.2f,%lld\n", libs[lib], w->name,
+		dir, bufsize, r.bytes, r.seconds,
+		r.bytes / r.seconds / (1 << 20), r.syscalls);
+	fflush(out);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d dir]... [-b bufsize]... [-s file_size] [-o out]\n",
+		prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *dirs[MAX_DIRS];
+	size_t bufsizes[MAX_BUFSIZES];
+	int ndirs = 0, nbufsizes = 0;
+	int d, b, lib, opt;
+	unsigned int i;
+	char path[4096];
+
+	out = stdout;
+	while ((opt = getopt(argc, argv, "d:b:s:o:")) != -1) {
+		switch (opt) {
+		case 'd':
+			if (ndirs == MAX_DIRS)
+				usage(argv[0]);
+			dirs[ndirs++] = optarg;
+			break;
+		case 'b':
+			if (nbufsizes == MAX_BUFSIZES)
+				usage(argv[0]);
+			bufsizes[nbufsizes++] = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			file_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			out = fopen(optarg, "w");
+			if (out == NULL) {
+				perror(optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (file_size <= SEEK_READ)
+		usage(argv[0]);
+	if (ndirs == 0) {
+		dirs[ndirs++] = "/dev/shm";
+		dirs[ndirs++] = ".";
+	}
+	if (nbufsizes == 0) {
+		bufsizes[nbufsizes++] = 4096;
+		bufsizes[nbufsizes++] = 65536;
+		bufsizes[nbufsizes++] = 1 << 20;
+	}
+
+	chunk = malloc(LARGE_ELEM);
+	if (chunk == NULL)
+		return EXIT_FAILURE;
+	for (i = 0; i < LARGE_ELEM; i++)
+		chunk[i] = 'a' + i % 26;
+
+	fprintf(out, "lib,workload,dir,bufsize,bytes,seconds,mb_per_s,"
+		"syscalls\n");
+
+	for (d = 0; d < ndirs; d++) {
+		snprintf(path, sizeof(path), "%s/so_bench.%d", dirs[d],
+			 getpid());
+
+		for (b = 0; b < nbufsizes; b++)
+			for (i = 0; i < sizeof(workloads) / sizeof(*workloads);
+			     i++) {
+				if (workloads[i].once && b != 0)
+					continue;
+				for (lib = 0; lib < 2; lib++)
+					run(&workloads[i], lib, dirs[d], path,
+					    bufsizes[b]);
+			}
+
+		unlink(path);
+	}
+
+	if (out != stdout)
+		fclose(out);
+
+	return 0;
+}
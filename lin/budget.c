@@ -0,0 +1,252 @@
+#include "utils.h"
+#include "budget.h"
+#include "bufmem.h"
+#include "autoflush.h"
+
+#define BUDGET_DEFAULT (64 << 20) /* default limit, in bytes */
+#define BUDGET_BUFSIZE_MAX (1 << 20) /* largest buffer a stream grows to */
+#define BUDGET_GROW_STREAK 4 /* full transfers in a row before growing */
+#define BUDGET_SHRINK_STREAK 16 /* score that makes a stream shrink */
+
+static size_t budget_limit = BUDGET_DEFAULT;
+static size_t budget_used; /* bytes of all stream buffers */
+
+/*
+ * Description: number of buffers the stream has allocated.
+ */
+static int nbuffers(SO_FILE *stream)
+{
+	return (stream->rbuffer != NULL) + (stream->wbuffer != NULL);
+}
+
+/*
+ * Description: takes size bytes from the budget; with force set, the
+ limit may be exceeded (buffers a stream can not work without).
+ * Return: 0/-1 if the budget is exhausted.
+ */
+static int budget_take(size_t size, int force)
+{
+	size_t used = __atomic_add_fetch(&budget_used, size, __ATOMIC_RELAXED);
+
+	if (force || used <= __atomic_load_n(&budget_limit, __ATOMIC_RELAXED))
+		return 0;
+
+	__atomic_sub_fetch(&budget_used, size, __ATOMIC_RELAXED);
+	return -1;
+}
+
+static void budget_give(size_t size)
+{
+	__atomic_sub_fetch(&budget_used, size, __ATOMIC_RELAXED);
+}
+
+/*
+ * Description: allocates the read buffer of a stream that released it
+ (or never used it). The read path runs without the stream lock, so it is
+ taken here: the autoflush timer may be resizing the write buffer.
+ * Return: 0/-1 if memory allocation fails.
+ */
+int budget_rbuffer(SO_FILE *stream)
+{
+	int rc = 0;
+
+	if (stream->rbuffer != NULL)
+		return 0;
+
+	autoflush_lock(stream);
+	stream->rbuffer = bufmem_alloc(stream->bufsize, 0);
+	if (stream->rbuffer != NULL) {
+		budget_take(stream->bufsize, 1);
+		stream->roffset = 0;
+		stream->rsize = 0;
+	} else {
+		rc = -1;
+	}
+	autoflush_unlock(stream);
+
+	return rc;
+}
+
+/*
+ * Description: allocates the write buffer of a stream that released it
+ (or never used it). Until then wlimit is 0, so so_putc calls so_fputc;
+ autoflush streams keep it at 0.
+ * Return: 0/-1 if memory allocation fails.
+ */
+int budget_wbuffer(SO_FILE *stream)
+{
+	if (stream->wbuffer != NULL)
+		return 0;
+
+	stream->wbuffer = bufmem_alloc(stream->bufsize, 0);
+	if (stream->wbuffer == NULL)
+		return -1;
+	budget_take(stream->bufsize, 1);
+	stream->woffset = 0;
+	stream->wlimit = stream->autoflush != NULL ? 0 : stream->bufsize;
+
+	return 0;
+}
+
+/*
+ * Description: accounts buffers allocated outside this module (direct
+ streams allocate aligned ones when they are opened).
+ */
+void budget_account(SO_FILE *stream)
+{
+	budget_take((size_t) nbuffers(stream) * stream->bufsize, 1);
+}
+
+/*
+ * Description: frees the buffers of a stream.
+ */
+void budget_free(SO_FILE *stream)
+{
+	budget_give((size_t) nbuffers(stream) * stream->bufsize);
+	bufmem_free(stream->rbuffer, stream->bufsize);
+	bufmem_free(stream->wbuffer, stream->bufsize);
+	stream->rbuffer = NULL;
+	stream->wbuffer = NULL;
+	stream->roffset = 0;
+	stream->rsize = 0;
+	stream->woffset = 0;
+	stream->wlimit = 0;
+}
+
+/*
+ * Description: moves the buffers of a stream to new ones of size bytes,
+ if the budget allows it. The data in them must fit in the new size.
+ * Return: 0/-1 if fails.
+ */
+static int budget_resize(SO_FILE *stream, int size)
+{
+	int n = nbuffers(stream);
+	char *rbuffer = NULL, *wbuffer = NULL;
+
+	if (size > stream->bufsize &&
+	    budget_take((size_t) n * (size - stream->bufsize), 0) < 0)
+		return -1;
+
+	if (stream->rbuffer != NULL)
+		rbuffer = bufmem_alloc(size, 0);
+	if (stream->wbuffer != NULL)
+		wbuffer = bufmem_alloc(size, 0);
+	if ((stream->rbuffer != NULL && rbuffer == NULL) ||
+	    (stream->wbuffer != NULL && wbuffer == NULL)) {
+		bufmem_free(rbuffer, size);
+		bufmem_free(wbuffer, size);
+		if (size > stream->bufsize)
+			budget_give((size_t) n * (size - stream->bufsize));
+		return -1;
+	}
+
+	if (rbuffer != NULL) {
+		memcpy(rbuffer, stream->rbuffer, stream->rsize);
+		bufmem_free(stream->rbuffer, stream->bufsize);
+		stream->rbuffer = rbuffer;
+	}
+	if (wbuffer != NULL) {
+		memcpy(wbuffer, stream->wbuffer, stream->woffset);
+		bufmem_free(stream->wbuffer, stream->bufsize);
+		stream->wbuffer = wbuffer;
+		stream->wlimit = stream->autoflush != NULL ? 0 : size;
+	}
+
+	if (size < stream->bufsize)
+		budget_give((size_t) n * (stream->bufsize - size));
+	stream->bufsize = size;
+
+	return 0;
+}
+
+/*
+ * Description: called after every refill (streak is rstreak) and flush
+ (wstreak), full being 1 if the whole buffer was moved; a seek that drops
+ read-ahead counts as a short refill. A stream that keeps moving whole
+ buffers gets buffers twice as large, up to 1 MiB. Short transfers weigh
+ twice as much as full ones, so a stream that moves little data, or that
+ reads one buffer after every seek, goes back towards SO_BUFSIZE. Streams
+ whose buffer size was chosen (so_setvbuf, direct streams) are left alone,
+ and so are autoflush streams that also read: the timer thread flushes
+ them under the stream lock, while the read path uses the read buffer
+ without it.
+ */
+void budget_adapt(SO_FILE *stream, int *streak, int full)
+{
+	int size;
+
+	if (stream->fixed ||
+	    (stream->autoflush != NULL && stream->rbuffer != NULL))
+		return;
+
+	if (full)
+		*streak += 1;
+	else
+		*streak = (*streak > 0 ? 0 : *streak) - 2;
+
+	if (*streak >= BUDGET_GROW_STREAK &&
+	    stream->bufsize <= BUDGET_BUFSIZE_MAX / 2) {
+		budget_resize(stream, stream->bufsize * 2);
+		*streak = 0;
+	} else if (*streak <= -BUDGET_SHRINK_STREAK &&
+		   stream->bufsize >= 2 * SO_BUFSIZE) {
+		size = stream->bufsize / 2;
+
+		/* Buffered data must fit in the smaller buffers: */
+		if (stream->rsize <= size && stream->woffset <= size)
+			budget_resize(stream, size);
+		*streak = 0;
+	}
+}
+
+/*
+ * Description: sets the limit of the memory that stream buffers may grow
+ to, over all streams. Streams always get buffers of SO_BUFSIZE; only the
+ growth of busy streams is limited.
+ * Return: previous limit.
+ */
+size_t so_setbudget(size_t limit)
+{
+	return __atomic_exchange_n(&budget_limit, limit, __ATOMIC_RELAXED);
+}
+
+/*
+ * Description: gives the memory of an idle stream back: pending output is
+ written, input read in advance is dropped (seeking back to the stream
+ position, so that it is read again) and both buffers are freed, to be
+ allocated again, with SO_BUFSIZE bytes, on the next use. Buffers are only
+ freed here (or when the stream is closed), never behind the caller.
+ * Return: 0/SO_EOF if fails.
+ */
+int so_ftrim(SO_FILE *stream)
+{
+	long pos;
+	int rc = 0;
+
+	if (stream->direct) {
+		errno = EINVAL;
+		return SO_EOF;
+	}
+
+	autoflush_lock(stream);
+
+	/* Same accounting as so_ftell, filtered read-ahead included: */
+	if (stream->rsize != stream->roffset) {
+		pos = ftell_locked(stream);
+		rc = (pos < 0) ? SO_EOF : fseek_locked(stream, pos, SEEK_SET);
+	} else if (stream->woffset != 0) {
+		rc = fflush_locked(stream);
+	}
+
+	if (rc == 0) {
+		budget_free(stream);
+		if (!stream->fixed)
+			stream->bufsize = SO_BUFSIZE;
+		stream->rstreak = 0;
+		stream->wstreak = 0;
+	}
+
+	autoflush_unlock(stream);
+
+	return rc;
+}
@@ -0,0 +1,18 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include "so_file.h"
+
+/*
+ * Buffer memory of all streams, taken from a process-wide budget. Buffers
+ are allocated on first use; streams that keep filling them get larger
+ ones, streams that do not give the memory back.
+ */
+
+int budget_rbuffer(SO_FILE *stream);
+int budget_wbuffer(SO_FILE *stream);
+void budget_free(SO_FILE *stream);
+void budget_account(SO_FILE *stream);
+void budget_adapt(SO_FILE *stream, int *streak, int full);
+
+#endif
@@ -0,0 +1,129 @@
+#define _GNU_SOURCE /* sched_getaffinity */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "utils.h"
+#include "bufmem.h"
+
+#define BUFMEM_MPOL_PREFERRED 1 /* MPOL_PREFERRED of linux/mempolicy.h */
+#define BUFMEM_MAX_NODES 1024 /* nodes in the mask passed to mbind */
+#define LONG_BITS (8 * sizeof(long))
+
+/* Rounds a size up to a multiple of BUFMEM_HUGE */
+#define HUGE_ROUND(size) (((size) + BUFMEM_HUGE - 1) & ~(size_t) (BUFMEM_HUGE - 1))
+
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+static int numa_nodes; /* more than one node and mbind is worth trying */
+static long ncpus;
+
+static void numa_init(void)
+{
+	numa_nodes = access("/sys/devices/system/node/node1", F_OK) == 0;
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+/*
+ * Description: finds the NUMA node of the calling thread, if the thread
+ is pinned (its affinity mask leaves out some CPUs), so that it keeps
+ running near the memory allocated for it. getcpu and sched_getaffinity
+ are called directly (no libnuma).
+ * Return: node/-1 if the thread is not pinned or there is one node.
+ */
+static int local_node(void)
+{
+	unsigned int cpu, node;
+	cpu_set_t set;
+
+	pthread_once(&numa_once, numa_init);
+	if (!numa_nodes)
+		return -1;
+
+	if (sched_getaffinity(0, sizeof(set), &set) < 0 ||
+	    CPU_COUNT(&set) >= ncpus)
+		return -1;
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0 ||
+	    node >= BUFMEM_MAX_NODES)
+		return -1;
+
+	return node;
+}
+
+/*
+ * Description: maps a buffer of size bytes (a multiple of BUFMEM_HUGE)
+ aligned to BUFMEM_HUGE, so that it can be backed by huge pages: a larger
+ area is mapped and the unaligned ends are unmapped. Before the pages are
+ touched, they get a preference for the node of a pinned thread (mbind
+ with MPOL_PREFERRED, which falls back to other nodes when the node is
+ full). Both hints are best effort: a kernel without transparent huge
+ pages or NUMA policies just ignores them.
+ * Return: buffer/NULL if mmap fails.
+ */
+static void *map_huge(size_t size)
+{
+	unsigned long mask[BUFMEM_MAX_NODES / LONG_BITS] = { 0 };
+	size_t head;
+	char *area;
+	int node;
+
+	area = mmap(NULL, size + BUFMEM_HUGE, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (area == MAP_FAILED)
+		return NULL;
+
+	head = -(uintptr_t) area & (BUFMEM_HUGE - 1);
+	if (head != 0)
+		munmap(area, head);
+	munmap(area + head + size, BUFMEM_HUGE - head);
+	area += head;
+
+	madvise(area, size, MADV_HUGEPAGE);
+
+	node = local_node();
+	if (node >= 0) {
+		mask[node / LONG_BITS] |= 1UL << (node % LONG_BITS);
+		/* The kernel counts maxnode one past the last bit: */
+		syscall(SYS_mbind, area, size, BUFMEM_MPOL_PREFERRED, mask,
+			BUFMEM_MAX_NODES + 1, 0);
+	}
+
+	return area;
+}
+
+/*
+ * Description: allocates a stream buffer of size bytes, aligned to align
+ (0 for malloc alignment; at most a page). Buffers of BUFMEM_HUGE bytes
+ or more are mapped, see map_huge.
+ * Return: buffer/NULL if memory allocation fails.
+ */
+void *bufmem_alloc(size_t size, size_t align)
+{
+	void *buf;
+
+	if (size >= BUFMEM_HUGE)
+		return map_huge(HUGE_ROUND(size));
+
+	if (align == 0)
+		return malloc(size);
+	if (posix_memalign(&buf, align, size) != 0)
+		return NULL;
+
+	return buf;
+}
+
+/*
+ * Description: frees a buffer allocated by bufmem_alloc(size, ...).
+ */
+void bufmem_free(void *buf, size_t size)
+{
+	if (buf == NULL)
+		return;
+
+	if (size >= BUFMEM_HUGE)
+		munmap(buf, HUGE_ROUND(size));
+	else
+		free(buf);
+}
@@ -0,0 +1,19 @@
+#ifndef BUFMEM_H
+#define BUFMEM_H
+
+#include <stddef.h>
+
+/*
+ * Memory of stream buffers. Large buffers (BUFMEM_HUGE bytes or more) are
+ mapped 2 MiB aligned and backed by transparent huge pages, on the NUMA
+ node of the allocating thread if it is pinned; the others come from
+ malloc. The size given to bufmem_free tells them apart, so it must be
+ the allocated one.
+ */
+
+#define BUFMEM_HUGE (2 << 20) /* size of a huge page */
+
+void *bufmem_alloc(size_t size, size_t align);
+void bufmem_free(void *buf, size_t size);
+
+#endif
@@ -0,0 +1,355 @@
+#include <glob.h>
+#include <pthread.h>
+
+#include "utils.h"
+#include "concat.h"
+#include "registry.h"
+#include "trace.h"
+
+#define CONCAT_AHEAD (1 << 20) /* bytes before EOF to start the prefetch */
+#define CONCAT_PREFETCH (64 << 10) /* bytes read by the prefetch */
+
+/*
+ * Structure for the state of a concatenated stream. stream->fd is the
+ descriptor of the current file. While it is read, a thread may open the
+ next file and read its first bytes, so switching files does not stall.
+ */
+struct concat {
+	char **paths;
+	size_t n;
+	off_t *sizes; /* updated once a file was read to its end */
+	size_t cur; /* current file */
+	off_t base; /* global offset of the start of the current file */
+	off_t pos; /* offset in the current file of the next byte returned */
+
+	char *pending; /* prefetched data of the current file, not read yet */
+	size_t pending_len;
+	size_t pending_off;
+
+	pthread_t thread; /* prefetch of file cur + 1 */
+	int prefetching; /* 1 while thread must be joined */
+	int pf_fd;
+	char *pf_buf;
+	ssize_t pf_len;
+};
+
+static void *prefetch_thread(void *arg)
+{
+	struct concat *cat = arg;
+
+	cat->pf_len = -1;
+	cat->pf_fd = open(cat->paths[cat->cur + 1], O_RDONLY);
+	if (cat->pf_fd >= 0)
+		cat->pf_len = xread(cat->pf_fd, cat->pf_buf, CONCAT_PREFETCH);
+
+	return NULL;
+}
+
+/*
+ * Description: starts the prefetch of the next file, once the current
+ one is close to its end.
+ */
+static void prefetch_start(SO_FILE *stream, off_t pos)
+{
+	struct concat *cat = stream->concat;
+
+	if (cat->prefetching || cat->cur + 1 >= cat->n ||
+	    pos + CONCAT_AHEAD < cat->sizes[cat->cur])
+		return;
+
+	if (cat->pf_buf == NULL) {
+		cat->pf_buf = malloc(CONCAT_PREFETCH);
+		if (cat->pf_buf == NULL)
+			return;
+	}
+	if (pthread_create(&cat->thread, NULL, prefetch_thread, cat) == 0)
+		cat->prefetching = 1;
+}
+
+/*
+ * Description: waits for the prefetch; its file is closed unless keep
+ is set.
+ * Return: 1 if the next file was opened by the prefetch/0 if not.
+ */
+static int prefetch_join(struct concat *cat, int keep)
+{
+	if (!cat->prefetching)
+		return 0;
+
+	pthread_join(cat->thread, NULL);
+	cat->prefetching = 0;
+	if (keep && cat->pf_fd >= 0 && cat->pf_len >= 0)
+		return 1;
+
+	if (cat->pf_fd >= 0)
+		close(cat->pf_fd);
+	return 0;
+}
+
+/*
+ * Description: makes file k current, positioned at offset off in it.
+ * Return: 0/-1 if fails.
+ */
+static int concat_switch(SO_FILE *stream, size_t k, off_t off)
+{
+	struct concat *cat = stream->concat;
+	char *buf;
+	size_t i;
+	int fd;
+
+	cat->pending_len = 0;
+	cat->pending_off = 0;
+
+	if (k == cat->cur) {
+		if (lseek(stream->fd, off, SEEK_SET) < 0)
+			return -1;
+		cat->pos = off;
+		return 0;
+	}
+
+	if (k == cat->cur + 1 && off == 0 && prefetch_join(cat, 1)) {
+		fd = cat->pf_fd;
+
+		/* Hand the prefetched bytes to concat_read: */
+		buf = cat->pending;
+		cat->pending = cat->pf_buf;
+		cat->pf_buf = buf;
+		cat->pending_len = cat->pf_len;
+	} else {
+		prefetch_join(cat, 0);
+		fd = open(cat->paths[k], O_RDONLY);
+		if (fd < 0)
+			return -1;
+		if (off != 0 && lseek(fd, off, SEEK_SET) < 0) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	close(stream->fd);
+	stream->fd = fd;
+	cat->cur = k;
+	cat->pos = off;
+	for (cat->base = 0, i = 0; i < k; i++)
+		cat->base += cat->sizes[i];
+
+	return 0;
+}
+
+/*
+ * Description: reads from the current file, moving to the next one when
+ it ends.
+ * Return: number of bytes read/0 at the end of the last file/-1 if fails.
+ */
+ssize_t concat_read(SO_FILE *stream, void *buf, size_t count)
+{
+	struct concat *cat = stream->concat;
+	unsigned long long start;
+	ssize_t rc;
+
+	for (;;) {
+		if (cat->pending_off < cat->pending_len) {
+			rc = cat->pending_len - cat->pending_off;
+			if ((size_t) rc > count)
+				rc = count;
+			memcpy(buf, cat->pending + cat->pending_off, rc);
+			cat->pending_off += rc;
+			cat->pos += rc;
+			STATS_ADD(stream, bytes_read, rc);
+			return rc;
+		}
+
+		start = now_ns();
+		do {
+			rc = read(stream->fd, buf, count);
+		} while (rc < 0 && errno == EINTR);
+		stats_syscalls(stream, 1, start);
+
+		if (rc != 0 || cat->cur + 1 == cat->n)
+			break;
+
+		/* End of this file, it may have changed since it was opened: */
+		cat->sizes[cat->cur] = cat->pos;
+		if (concat_switch(stream, cat->cur + 1, 0) < 0)
+			return -1;
+	}
+
+	if (rc > 0) {
+		cat->pos += rc;
+		STATS_ADD(stream, bytes_read, rc);
+		prefetch_start(stream, cat->pos);
+	}
+
+	return rc;
+}
+
+/*
+ * Description: lseek over the concatenation of the files.
+ * Return: global offset/-1 if fails.
+ */
+off_t concat_lseek(SO_FILE *stream, off_t offset, int whence)
+{
+	struct concat *cat = stream->concat;
+	unsigned long long start;
+	off_t target, total = 0;
+	struct stat st;
+	size_t k;
+	int rc;
+
+	if (whence == SEEK_CUR && offset == 0)
+		return cat->base + cat->pos;
+
+	if (whence == SEEK_SET) {
+		target = offset;
+	} else if (whence == SEEK_CUR) {
+		target = cat->base + cat->pos + offset;
+	} else if (whence == SEEK_END) {
+		start = now_ns();
+		rc = fstat(stream->fd, &st);
+		stats_syscalls(stream, 1, start);
+		if (rc == 0 && st.st_size > cat->sizes[cat->cur])
+			cat->sizes[cat->cur] = st.st_size;
+		for (k = 0; k < cat->n; k++)
+			total += cat->sizes[k];
+		target = total + offset;
+	} else {
+		errno = EINVAL;
+		return -1;
+	}
+	if (target < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Find the file holding target (the last one past the end): */
+	for (k = 0, total = 0; k + 1 < cat->n; k++) {
+		if (target < total + cat->sizes[k])
+			break;
+		total += cat->sizes[k];
+	}
+
+	start = now_ns();
+	rc = concat_switch(stream, k, target - total);
+	stats_syscalls(stream, 1, start);
+
+	return rc < 0 ? -1 : target;
+}
+
+/*
+ * Description: frees the state of a concatenated stream, after its
+ current file was closed.
+ */
+void concat_free(SO_FILE *stream)
+{
+	struct concat *cat = stream->concat;
+	size_t i;
+
+	if (cat == NULL)
+		return;
+
+	prefetch_join(cat, 0);
+	for (i = 0; i < cat->n; i++)
+		free(cat->paths[i]);
+	free(cat->paths);
+	free(cat->sizes);
+	free(cat->pending);
+	free(cat->pf_buf);
+	free(cat);
+	stream->concat = NULL;
+}
+
+/*
+ * Description: sets up the state of a concatenated stream and opens its
+ first file. Every file must exist; their sizes give the global offsets.
+ * Return: 0/-1 if fails.
+ */
+static int concat_open(SO_FILE *stream, const char * const *paths, size_t n)
+{
+	struct concat *cat;
+	struct stat st;
+	size_t i;
+
+	if (n == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	cat = calloc(1, sizeof(*cat));
+	if (cat == NULL)
+		return -1;
+	stream->concat = cat;
+	cat->paths = calloc(n, sizeof(*cat->paths));
+	cat->sizes = calloc(n, sizeof(*cat->sizes));
+	if (cat->paths == NULL || cat->sizes == NULL)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		if (stat(paths[i], &st) < 0)
+			return -1;
+		cat->paths[i] = strdup(paths[i]);
+		if (cat->paths[i] == NULL)
+			return -1;
+		cat->n++;
+		cat->sizes[i] = st.st_size;
+	}
+
+	stream->fd = open(paths[0], O_RDONLY);
+
+	return stream->fd < 0 ? -1 : 0;
+}
+
+/*
+ * Description: opens n files for reading as one stream, in the given
+ order. so_ftell and so_fseek use offsets in the concatenation. The next
+ file is opened and its first bytes are read in the background while the
+ end of the current one is read.
+ * Return: stream/NULL if fails.
+ */
+SO_FILE *so_fopen_concat(const char * const *paths, size_t n)
+{
+	SO_FILE *stream = alloc_stream(SO_BUFSIZE, 0);
+
+	if (stream == NULL)
+		return NULL;
+
+	TRACE_START(start);
+	stream->flags = O_RDONLY;
+	stream->fd = -1;
+	if (concat_open(stream, paths, n) < 0) {
+		TRACE_END(start, TRACE_OPEN, -1, 0);
+		if (stream->fd >= 0)
+			close(stream->fd);
+		free_stream(stream);
+		return NULL;
+	}
+	TRACE_END(start, TRACE_OPEN, stream->fd, n);
+	registry_add(stream);
+
+	return stream;
+}
+
+/*
+ * Description: opens the files matching pattern (as glob(3) sorts them)
+ as one stream, see so_fopen_concat.
+ * Return: stream/NULL if fails or nothing matches.
+ */
+SO_FILE *so_fopen_glob(const char *pattern)
+{
+	SO_FILE *stream;
+	glob_t g;
+	int rc;
+
+	rc = glob(pattern, 0, NULL, &g);
+	if (rc != 0) {
+		errno = rc == GLOB_NOMATCH ? ENOENT : ENOMEM;
+		if (rc != GLOB_NOMATCH)
+			globfree(&g);
+		return NULL;
+	}
+
+	stream = so_fopen_concat((const char * const *) g.gl_pathv,
+				 g.gl_pathc);
+	globfree(&g);
+
+	return stream;
+}
@@ -0,0 +1,16 @@
+#ifndef CONCAT_H
+#define CONCAT_H
+
+#include "so_file.h"
+
+/*
+ * Several files read as one stream (so_fopen_concat). stream_read and
+ stream_lseek go through concat_read and concat_lseek, which move between
+ the files; offsets are global, over all files.
+ */
+
+ssize_t concat_read(SO_FILE *stream, void *buf, size_t count);
+off_t concat_lseek(SO_FILE *stream, off_t offset, int whence);
+void concat_free(SO_FILE *stream);
+
+#endif
@@ -0,0 +1,301 @@
+#include "utils.h"
+#include "csv.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CSV_X86
+#endif
+
+/*
+ * Structure for the tokenizer state of a stream.
+ */
+struct csv {
+	char *scratch; /* fields that cross a refill are built here */
+	size_t len; /* bytes used in scratch */
+	size_t capacity;
+	int record_start; /* 1 if the next field starts a record */
+};
+
+/*
+ * Structure for the field being built: either in place, in rbuffer
+ (out points inside it and unescaping only moves bytes back), or in the
+ scratch buffer once the field crossed a refill.
+ */
+struct field_out {
+	char *out; /* start of the field in rbuffer, NULL if in scratch */
+	size_t len;
+	size_t unquoted; /* bytes appended since the last closing quote */
+};
+
+typedef const char *(*find2_fn)(const char *p, const char *end, char a,
+				char b);
+
+/*
+ * Description: finds the first byte equal to a or b.
+ * Return: pointer to it/end if there is none.
+ */
+static const char *find2_scalar(const char *p, const char *end, char a,
+				char b)
+{
+	for (; p < end; p++)
+		if (*p == a || *p == b)
+			break;
+
+	return p;
+}
+
+#ifdef CSV_X86
+static const char *find2_sse2(const char *p, const char *end, char a,
+			      char b)
+{
+	__m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b), v;
+	int mask;
+
+	for (; end - p >= 16; p += 16) {
+		v = _mm_loadu_si128((const __m128i *) p);
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va),
+						      _mm_cmpeq_epi8(v, vb)));
+		if (mask != 0)
+			return p + __builtin_ctz(mask);
+	}
+
+	return find2_scalar(p, end, a, b);
+}
+
+__attribute__((target("avx2")))
+static const char *find2_avx2(const char *p, const char *end, char a,
+			      char b)
+{
+	__m256i va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b), v;
+	unsigned int mask;
+
+	for (; end - p >= 32; p += 32) {
+		v = _mm256_loadu_si256((const __m256i *) p);
+		mask = _mm256_movemask_epi8(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, va),
+					_mm256_cmpeq_epi8(v, vb)));
+		if (mask != 0)
+			return p + __builtin_ctz(mask);
+	}
+
+	return find2_sse2(p, end, a, b);
+}
+#endif
+
+/*
+ * Description: picks the widest find2 the CPU supports.
+ */
+static find2_fn find2_select(void)
+{
+#ifdef CSV_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return find2_avx2;
+	return find2_sse2;
+#else
+	return find2_scalar;
+#endif
+}
+
+static find2_fn find2;
+
+/*
+ * Description: makes room for len more bytes in the scratch buffer.
+ * Return: 0/-1 if memory allocation fails.
+ */
+static int scratch_reserve(struct csv *csv, size_t len)
+{
+	size_t capacity = csv->capacity ? csv->capacity : 256;
+	char *p;
+
+	if (csv->len + len <= csv->capacity)
+		return 0;
+
+	while (capacity < csv->len + len)
+		capacity = capacity > SIZE_MAX / 2 ? csv->len + len :
+						   capacity * 2;
+	p = realloc(csv->scratch, capacity);
+	if (p == NULL)
+		return -1;
+	csv->scratch = p;
+	csv->capacity = capacity;
+
+	return 0;
+}
+
+/*
+ * Description: appends len bytes from src to the field.
+ * Return: 0/-1 if memory allocation fails.
+ */
+static int field_append(struct csv *csv, struct field_out *f,
+			const char *src, size_t len)
+{
+	if (f->out != NULL) {
+		if (f->out + f->len != src)
+			memmove(f->out + f->len, src, len);
+	} else {
+		if (scratch_reserve(csv, len) < 0)
+			return -1;
+		memcpy(csv->scratch + f->len, src, len);
+		csv->len = f->len + len;
+	}
+	f->len += len;
+
+	return 0;
+}
+
+/*
+ * Description: refills the read buffer in the middle of a field, moving
+ the part built so far to the scratch buffer first.
+ * Return: bytes read/0 at EOF/-1 if fails.
+ */
+static int field_refill(SO_FILE *stream, struct csv *csv, struct field_out *f)
+{
+	stream->roffset = stream->rsize;
+	if (f->out != NULL) {
+		csv->len = 0;
+		if (scratch_reserve(csv, f->len) < 0)
+			return -1;
+		memcpy(csv->scratch, f->out, f->len);
+		csv->len = f->len;
+		f->out = NULL;
+	}
+
+	return load_rbuffer(stream);
+}
+
+/*
+ * Description: reads the next field of a delimited file (CSV with ',',
+ TSV with '\t'...). A field in double quotes may contain the delimiter,
+ newlines and "" for a quote; a record ends with "\n" or "\r\n". The
+ returned span points into the read buffer when the field fits in it and
+ into a scratch buffer of the stream when it crosses a refill; either way
+ it is valid until the next operation on the stream. Quoted fields are
+ unescaped in place. Non-blocking streams are not supported.
+ * Return: 1 if a field was read/0 at EOF/SO_EOF if fails.
+ */
+int so_fnextfield(SO_FILE *stream, char delim, struct so_field *field)
+{
+	struct csv *csv = stream->csv;
+	struct field_out f = { NULL, 0, 0 };
+	const char *p, *end, *q;
+	int quoted = 0, rc;
+	char term = 0;
+
+	if (stream->nonblock || delim == '"' || delim == '\n') {
+		errno = EINVAL;
+		return SO_EOF;
+	}
+
+	if (csv == NULL) {
+		csv = stream->csv = calloc(1, sizeof(*csv));
+		if (csv == NULL)
+			return SO_EOF;
+		csv->record_start = 1;
+	}
+	if (__atomic_load_n(&find2, __ATOMIC_RELAXED) == NULL)
+		__atomic_store_n(&find2, find2_select(), __ATOMIC_RELAXED);
+
+	if (stream->roffset == stream->rsize) {
+		rc = load_rbuffer(stream);
+		if (rc < 0)
+			return SO_EOF;
+		if (rc == 0) {
+			if (csv->record_start)
+				return 0;
+			/* The record ended with a delimiter: */
+			goto done;
+		}
+	}
+
+	p = stream->rbuffer + stream->roffset;
+	end = stream->rbuffer + stream->rsize;
+	f.out = (char *) p;
+	if (*p == '"') {
+		quoted = 1;
+		f.out++;
+		p++;
+	}
+
+	for (;;) {
+		if (p == end) {
+			rc = field_refill(stream, csv, &f);
+			if (rc < 0)
+				return SO_EOF;
+			if (rc == 0)
+				break;
+			p = stream->rbuffer + stream->roffset;
+			end = stream->rbuffer + stream->rsize;
+		}
+
+		if (!quoted) {
+			q = find2(p, end, delim, '\n');
+			if (field_append(csv, &f, p, q - p) < 0)
+				return SO_EOF;
+			f.unquoted += q - p;
+			p = q;
+			if (q < end) {
+				term = *p++;
+				break;
+			}
+			continue;
+		}
+
+		q = memchr(p, '"', end - p);
+		if (q == NULL)
+			q = end;
+		if (field_append(csv, &f, p, q - p) < 0)
+			return SO_EOF;
+		p = q;
+		if (q == end)
+			continue;
+
+		/* A quote, either closing or the first of "": */
+		p++;
+		if (p == end) {
+			rc = field_refill(stream, csv, &f);
+			if (rc < 0)
+				return SO_EOF;
+			if (rc == 0)
+				break;
+			p = stream->rbuffer + stream->roffset;
+			end = stream->rbuffer + stream->rsize;
+		}
+		if (*p == '"') {
+			if (field_append(csv, &f, p, 1) < 0)
+				return SO_EOF;
+			p++;
+		} else {
+			quoted = 0;
+			f.unquoted = 0;
+		}
+	}
+
+	/* At EOF, field_refill already consumed the buffer: */
+	if (term != 0)
+		stream->roffset = p - stream->rbuffer;
+
+done:
+	/* "\r\n" ends the record, unless the '\r' was quoted: */
+	field->data = f.out != NULL ? f.out : csv->scratch;
+	if (term == '\n' && f.unquoted > 0 && field->data[f.len - 1] == '\r')
+		f.len--;
+	field->len = f.len;
+	field->last = (term != delim);
+	csv->record_start = field->last;
+
+	return 1;
+}
+
+/*
+ * Description: frees the tokenizer state of a stream.
+ */
+void csv_free(SO_FILE *stream)
+{
+	if (stream->csv == NULL)
+		return;
+
+	free(stream->csv->scratch);
+	free(stream->csv);
+	stream->csv = NULL;
+}
@@ -0,0 +1,14 @@
+#ifndef CSV_H
+#define CSV_H
+
+#include "so_file.h"
+
+/*
+ * Delimited-record tokenizer (so_fnextfield). Fields are returned as
+ spans into rbuffer; only a field that crosses a refill is copied, into
+ the scratch buffer of the stream.
+ */
+
+void csv_free(SO_FILE *stream);
+
+#endif
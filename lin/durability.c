@@ -0,0 +1,349 @@
+#define _GNU_SOURCE /* sync_file_range */
+
+#include <pthread.h>
+
+#include "utils.h"
+#include "durability.h"
+
+/*
+ * Structure for a group commit: all streams in SO_DURABLE_GROUP mode on
+ the same file share one. A stream that needs a sync takes a ticket; the
+ first one to find no sync running becomes the leader and runs a single
+ fdatasync covering every ticket taken so far, while the others wait.
+ */
+struct commit_group {
+	dev_t dev; /* identifies the file */
+	ino_t ino;
+	int refs; /* streams using the group */
+	struct commit_group *next; /* next group in the list of groups */
+
+	pthread_mutex_t lock;
+	pthread_cond_t done; /* signaled when a sync finishes */
+	unsigned long long requested; /* tickets taken */
+	unsigned long long synced; /* tickets covered by a finished sync */
+	int syncing; /* 1 while the leader runs fdatasync */
+};
+
+/*
+ * Structure for the durability state of a stream.
+ */
+struct durability {
+	int mode; /* SO_DURABLE_* */
+	int dirty; /* 1 if data was written since the last sync */
+	struct commit_group *group; /* for SO_DURABLE_GROUP */
+
+	size_t writeback; /* writeback window, 0 if disabled */
+	off_t wb_off; /* current window: the bytes written since the last */
+	off_t wb_len;
+	off_t wb_prev_off; /* previous window, still being written back */
+	off_t wb_prev_len;
+};
+
+static struct commit_group *groups;
+static pthread_mutex_t groups_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Description: finds the group of the file, creating it if needed.
+ * Return: group/NULL if memory allocation fails.
+ */
+static struct commit_group *get_group(struct stat *st)
+{
+	struct commit_group *group;
+
+	pthread_mutex_lock(&groups_lock);
+
+	for (group = groups; group != NULL; group = group->next)
+		if (group->dev == st->st_dev && group->ino == st->st_ino)
+			break;
+
+	if (group == NULL) {
+		group = calloc(1, sizeof(*group));
+		if (group != NULL) {
+			group->dev = st->st_dev;
+			group->ino = st->st_ino;
+			pthread_mutex_init(&group->lock, NULL);
+			pthread_cond_init(&group->done, NULL);
+			group->next = groups;
+			groups = group;
+		}
+	}
+
+	if (group != NULL)
+		group->refs++;
+
+	pthread_mutex_unlock(&groups_lock);
+
+	return group;
+}
+
+/*
+ * Description: drops a reference to a group, freeing it if unused.
+ */
+static void put_group(struct commit_group *group)
+{
+	struct commit_group **p;
+
+	pthread_mutex_lock(&groups_lock);
+
+	if (--group->refs == 0) {
+		for (p = &groups; *p != group; p = &(*p)->next)
+			;
+		*p = group->next;
+		pthread_mutex_destroy(&group->lock);
+		pthread_cond_destroy(&group->done);
+		free(group);
+	}
+
+	pthread_mutex_unlock(&groups_lock);
+}
+
+/*
+ * Description: fdatasync wrapper that updates stream statistics.
+ */
+static int stream_fdatasync(SO_FILE *stream)
+{
+	unsigned long long start = now_ns();
+	int rc = fdatasync(stream->fd);
+
+	stats_syscalls(stream, 1, start);
+	return rc;
+}
+
+/*
+ * Description: waits until a fdatasync started after this call finishes,
+ running it if no other stream of the group does.
+ * Return: 0/-1 if fdatasync fails.
+ */
+static int group_sync(SO_FILE *stream, struct commit_group *group)
+{
+	unsigned long long ticket, target;
+	int rc = 0;
+
+	pthread_mutex_lock(&group->lock);
+
+	ticket = ++group->requested;
+	while (group->synced < ticket) {
+		if (group->syncing) {
+			pthread_cond_wait(&group->done, &group->lock);
+			continue;
+		}
+
+		/* Become the leader for every ticket taken so far: */
+		group->syncing = 1;
+		target = group->requested;
+		pthread_mutex_unlock(&group->lock);
+
+		rc = stream_fdatasync(stream);
+
+		pthread_mutex_lock(&group->lock);
+		group->syncing = 0;
+		if (rc == 0)
+			group->synced = target;
+		pthread_cond_broadcast(&group->done);
+
+		/* On failure, a waiter retries as the next leader. */
+		if (rc < 0)
+			break;
+	}
+
+	pthread_mutex_unlock(&group->lock);
+
+	return rc;
+}
+
+/*
+ * Description: starts writeback of the current window and waits for the
+ previous one, so that at most two windows of dirty pages are
+ outstanding. If the file does not support sync_file_range, windows are
+ disabled and the sync does all the work; other failures (EIO) are write
+ errors of the stream.
+ */
+static void writeback_window(SO_FILE *stream, struct durability *dur)
+{
+	unsigned long long start = now_ns();
+	unsigned int calls = 1;
+	int rc;
+
+	rc = sync_file_range(stream->fd, dur->wb_off, dur->wb_len,
+			     SYNC_FILE_RANGE_WRITE);
+	if (rc == 0 && dur->wb_prev_len != 0) {
+		rc = sync_file_range(stream->fd, dur->wb_prev_off,
+				     dur->wb_prev_len,
+				     SYNC_FILE_RANGE_WAIT_BEFORE |
+				     SYNC_FILE_RANGE_WRITE |
+				     SYNC_FILE_RANGE_WAIT_AFTER);
+		calls++;
+	}
+	stats_syscalls(stream, calls, start);
+
+	if (rc < 0) {
+		if (errno == EINVAL || errno == ENOSYS || errno == ESPIPE ||
+		    errno == EOPNOTSUPP)
+			dur->writeback = 0;
+		else
+			stream->werror = SO_EOF;
+	}
+
+	dur->wb_prev_off = dur->wb_off;
+	dur->wb_prev_len = dur->wb_len;
+	dur->wb_len = 0;
+}
+
+/*
+ * Description: accounts count bytes just written. With writeback windows,
+ the bytes end at the file offset (O_APPEND moves it past them too, even
+ with other writers), so each write is placed where it really went: a
+ write that does not follow the window (after a seek) closes it, and a
+ full window is written back.
+ */
+void durability_written(SO_FILE *stream, size_t count)
+{
+	struct durability *dur = stream->durability;
+	off_t off;
+
+	dur->dirty = 1;
+	if (dur->writeback == 0)
+		return;
+
+	off = stream_lseek(stream, 0, SEEK_CUR);
+	if (off < (off_t) count)
+		return;
+	off -= count;
+
+	if (dur->wb_len != 0 && off != dur->wb_off + dur->wb_len)
+		writeback_window(stream, dur);
+	if (dur->wb_len == 0)
+		dur->wb_off = off;
+	dur->wb_len += count;
+
+	if (dur->writeback != 0 && (size_t) dur->wb_len >= dur->writeback)
+		writeback_window(stream, dur);
+}
+
+/*
+ * Description: makes the data written so far durable, as the mode of the
+ stream requires.
+ * Return: 0/-1 if fails.
+ */
+int durability_sync(SO_FILE *stream)
+{
+	struct durability *dur = stream->durability;
+	int rc;
+
+	if (!dur->dirty || dur->mode == SO_DURABLE_NONE)
+		return 0;
+
+	if (dur->mode == SO_DURABLE_GROUP)
+		rc = group_sync(stream, dur->group);
+	else
+		rc = stream_fdatasync(stream);
+
+	if (rc == 0)
+		dur->dirty = 0;
+	else
+		stream->werror = SO_EOF;
+
+	return rc;
+}
+
+/*
+ * Description: fork handlers, called by those of the registry. The group
+ locks are held across fork; the child, where no leader runs fdatasync,
+ gets them reset.
+ */
+void durability_fork_prepare(void)
+{
+	struct commit_group *group;
+
+	pthread_mutex_lock(&groups_lock);
+	for (group = groups; group != NULL; group = group->next)
+		pthread_mutex_lock(&group->lock);
+}
+
+void durability_fork_parent(void)
+{
+	struct commit_group *group;
+
+	for (group = groups; group != NULL; group = group->next)
+		pthread_mutex_unlock(&group->lock);
+	pthread_mutex_unlock(&groups_lock);
+}
+
+void durability_fork_child(void)
+{
+	struct commit_group *group;
+
+	for (group = groups; group != NULL; group = group->next) {
+		pthread_mutex_init(&group->lock, NULL);
+		pthread_cond_init(&group->done, NULL);
+		group->syncing = 0;
+	}
+	pthread_mutex_init(&groups_lock, NULL);
+}
+
+/*
+ * Description: frees the durability state of a stream.
+ */
+void durability_free(SO_FILE *stream)
+{
+	struct durability *dur = stream->durability;
+
+	if (dur == NULL)
+		return;
+
+	if (dur->group != NULL)
+		put_group(dur->group);
+	free(dur);
+	stream->durability = NULL;
+}
+
+/*
+ * Description: sets when data written to a regular file is made durable:
+ never (SO_DURABLE_NONE), by a fdatasync at every so_fflush/so_fclose
+ (SO_DURABLE_FLUSH) or by a fdatasync shared by all streams of the file
+ that flush at the same time (SO_DURABLE_GROUP). If writeback is not 0,
+ writeback of every writeback bytes written is started right away, so
+ dirty pages do not pile up until the sync.
+ * Return: 0/SO_EOF if fails.
+ */
+int so_fsetdurability(SO_FILE *stream, int mode, size_t writeback)
+{
+	struct durability *dur;
+	struct stat st;
+
+	if (mode != SO_DURABLE_NONE && mode != SO_DURABLE_FLUSH &&
+	    mode != SO_DURABLE_GROUP) {
+		errno = EINVAL;
+		return SO_EOF;
+	}
+
+	if (fstat(stream->fd, &st) < 0)
+		return SO_EOF;
+	if (!S_ISREG(st.st_mode) || (stream->flags & O_ACCMODE) == O_RDONLY) {
+		errno = EINVAL;
+		return SO_EOF;
+	}
+
+	dur = calloc(1, sizeof(*dur));
+	if (dur == NULL)
+		return SO_EOF;
+
+	if (mode == SO_DURABLE_GROUP) {
+		dur->group = get_group(&st);
+		if (dur->group == NULL) {
+			free(dur);
+			return SO_EOF;
+		}
+	}
+
+	/* Data written in the previous mode still needs a sync: */
+	if (stream->durability != NULL)
+		dur->dirty = stream->durability->dirty;
+	durability_free(stream);
+
+	dur->mode = mode;
+	dur->writeback = writeback;
+	stream->durability = dur;
+
+	return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef DURABILITY_H
+#define DURABILITY_H
+
+#include "so_file.h"
+
+/*
+ * Durable writes (so_fsetdurability). stream_write reports every write
+ to durability_written, so_fflush and so_fclose call durability_sync.
+ */
+
+void durability_written(SO_FILE *stream, size_t count);
+int durability_sync(SO_FILE *stream);
+void durability_free(SO_FILE *stream);
+
+void durability_fork_prepare(void);
+void durability_fork_parent(void);
+void durability_fork_child(void);
+
+#endif
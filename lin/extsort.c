@@ -0,0 +1,570 @@
+#define _GNU_SOURCE /* memrchr */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "utils.h"
+#include "so_file.h"
+#include "registry.h"
+
+#define SORT_MEMORY (256 << 20) /* default memory for the runs */
+#define SORT_FANIN 128 /* runs merged at once */
+#define SORT_RUN_BUFSIZE (1 << 20) /* write buffer of runs and output */
+
+/*
+ * Runs are sorted chunks of the input written to temporary files as
+ length-prefixed records (so_fwrite_record), so lines and fixed-size
+ records are merged the same way and read back without copying.
+ */
+
+/*
+ * Structure for a record being sorted. prefix holds its first 8 bytes,
+ big-endian and zero padded, so most comparisons need no memcmp.
+ */
+struct sort_key {
+	uint64_t prefix;
+	const char *data;
+	size_t len;
+};
+
+/*
+ * Structure for the state shared by the run generating threads.
+ */
+struct sort_job {
+	const struct so_sort_opts *opts;
+	pthread_mutex_t lock; /* protects everything below */
+	SO_FILE *in;
+	char *carry; /* start of a line cut by the previous chunk */
+	size_t carry_len;
+	int eof;
+	int failed;
+	int err; /* errno of the first failure */
+	char **runs;
+	size_t nruns;
+	size_t capacity;
+};
+
+static uint64_t key_prefix(const char *data, size_t len)
+{
+	uint64_t prefix = 0;
+	size_t i;
+
+	for (i = 0; i < 8; i++)
+		prefix = (prefix << 8) | (i < len ? (unsigned char) data[i] : 0);
+
+	return prefix;
+}
+
+/*
+ * Description: compares records bytewise; a proper prefix sorts first.
+ */
+static int record_cmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+	int rc = memcmp(a, b, alen < blen ? alen : blen);
+
+	if (rc != 0)
+		return rc;
+
+	return (alen > blen) - (alen < blen);
+}
+
+static int key_cmp(const void *pa, const void *pb)
+{
+	const struct sort_key *a = pa, *b = pb;
+
+	if (a->prefix != b->prefix)
+		return a->prefix < b->prefix ? -1 : 1;
+
+	return record_cmp(a->data, a->len, b->data, b->len);
+}
+
+/*
+ * Description: records the first failure of a sorting job.
+ */
+static void job_fail(struct sort_job *job)
+{
+	pthread_mutex_lock(&job->lock);
+	if (!job->failed) {
+		job->failed = 1;
+		job->err = errno;
+	}
+	pthread_mutex_unlock(&job->lock);
+}
+
+/*
+ * Description: creates a new temporary file for a run, with mkostemp: its
+ name is unique, so concurrent sorts do not share runs, and it is created
+ with O_EXCL, so a link planted in a shared tmpdir is not followed. The
+ descriptor is wrapped in a write stream; its name goes to *name.
+ * Return: stream/NULL if fails.
+ */
+static SO_FILE *run_create(struct sort_job *job, char **name)
+{
+	const char *dir = job->opts->tmpdir ? job->opts->tmpdir : "/tmp";
+	SO_FILE *run;
+	int fd;
+
+	*name = malloc(strlen(dir) + sizeof("/so_sort.XXXXXX"));
+	if (*name == NULL)
+		return NULL;
+	sprintf(*name, "%s/so_sort.XXXXXX", dir);
+
+	fd = mkostemp(*name, O_CLOEXEC);
+	if (fd < 0) {
+		free(*name);
+		return NULL;
+	}
+
+	run = alloc_stream(SO_BUFSIZE, 0);
+	if (run != NULL)
+		run->pathname = strdup(*name);
+	if (run == NULL || run->pathname == NULL) {
+		if (run != NULL)
+			free_stream(run);
+		close(fd);
+		unlink(*name);
+		free(*name);
+		return NULL;
+	}
+	run->fd = fd;
+	run->flags = O_WRONLY | O_CREAT | O_TRUNC;
+	so_setvbuf(run, SORT_RUN_BUFSIZE);
+	registry_add(run);
+
+	return run;
+}
+
+/*
+ * Description: adds a run to the list of the job. Called with the lock
+ held.
+ * Return: 0/-1 if memory allocation fails.
+ */
+static int job_add_run(struct sort_job *job, char *name)
+{
+	char **runs;
+
+	if (job->nruns == job->capacity) {
+		runs = realloc(job->runs, (job->capacity * 2 + 16) *
+			       sizeof(*runs));
+		if (runs == NULL)
+			return -1;
+		job->runs = runs;
+		job->capacity = job->capacity * 2 + 16;
+	}
+	job->runs[job->nruns++] = name;
+
+	return 0;
+}
+
+/*
+ * Description: fills chunk with the next part of the input: the line cut
+ by the previous chunk, then as much as fits, read straight into chunk
+ (so_fread skips the stream buffer for large reads). For lines, the part
+ after the last '\n' is kept for the next chunk.
+ * Return: bytes in chunk/0 at the end of the input/-1 if fails.
+ */
+static ssize_t job_read(struct sort_job *job, char *chunk, size_t size)
+{
+	size_t len, end;
+	char *nl;
+
+	pthread_mutex_lock(&job->lock);
+	if (job->eof || job->failed) {
+		pthread_mutex_unlock(&job->lock);
+		return 0;
+	}
+
+	memcpy(chunk, job->carry, job->carry_len);
+	len = job->carry_len;
+	len += so_fread(chunk + len, 1, size - len, job->in);
+	job->carry_len = 0;
+	if (len < size) {
+		job->eof = 1;
+		if (so_ferror(job->in) && !so_feof(job->in))
+			len = -1;
+	}
+
+	if (job->opts->record_size == 0 && !job->eof) {
+		nl = memrchr(chunk, '\n', len);
+		if (nl == NULL) {
+			/* A line longer than the chunk: */
+			errno = ENOMEM;
+			len = -1;
+		} else {
+			end = nl + 1 - chunk;
+			job->carry_len = len - end;
+			memcpy(job->carry, chunk + end, job->carry_len);
+			len = end;
+		}
+	}
+	pthread_mutex_unlock(&job->lock);
+
+	return len;
+}
+
+/*
+ * Description: splits a chunk into records and sorts them.
+ * Return: number of records/-1 if memory allocation fails.
+ */
+static ssize_t chunk_sort(const struct so_sort_opts *opts, char *chunk,
+			  size_t len, struct sort_key **keys, size_t *capacity)
+{
+	size_t n = 0, pos, rlen;
+	struct sort_key *k;
+	char *nl;
+
+	for (pos = 0; pos < len; pos += rlen + (opts->record_size == 0)) {
+		if (opts->record_size != 0) {
+			rlen = len - pos < opts->record_size ?
+			       len - pos : opts->record_size;
+		} else {
+			nl = memchr(chunk + pos, '\n', len - pos);
+			rlen = (nl != NULL ? nl : chunk + len) - (chunk + pos);
+		}
+
+		if (n == *capacity) {
+			k = realloc(*keys, (*capacity * 2 + 1024) * sizeof(*k));
+			if (k == NULL)
+				return -1;
+			*keys = k;
+			*capacity = *capacity * 2 + 1024;
+		}
+		(*keys)[n].prefix = key_prefix(chunk + pos, rlen);
+		(*keys)[n].data = chunk + pos;
+		(*keys)[n].len = rlen;
+		n++;
+	}
+
+	qsort(*keys, n, sizeof(**keys), key_cmp);
+
+	return n;
+}
+
+/*
+ * Description: writes sorted records to a new run file.
+ * Return: 0/-1 if fails.
+ */
+static int run_write(struct sort_job *job, struct sort_key *keys, size_t n)
+{
+	struct so_record batch[256];
+	size_t i, k;
+	SO_FILE *run;
+	char *name;
+	int rc = 0;
+
+	run = run_create(job, &name);
+	if (run == NULL)
+		return -1;
+
+	for (i = 0; i < n && rc == 0; i += k) {
+		for (k = 0; k < 256 && i + k < n; k++) {
+			batch[k].data = keys[i + k].data;
+			batch[k].len = keys[i + k].len;
+		}
+		if (so_fwrite_records(run, batch, k) != k)
+			rc = -1;
+	}
+	if (so_fclose(run) != 0)
+		rc = -1;
+
+	pthread_mutex_lock(&job->lock);
+	if (rc == 0 && job_add_run(job, name) < 0)
+		rc = -1;
+	pthread_mutex_unlock(&job->lock);
+	if (rc < 0) {
+		unlink(name);
+		free(name);
+	}
+
+	return rc;
+}
+
+/*
+ * Description: run generating thread: reads a chunk, sorts it and writes
+ it as a run, until the input ends.
+ */
+static void *run_thread(void *arg)
+{
+	struct sort_job *job = arg;
+	size_t size = job->opts->memory / job->opts->threads;
+	struct sort_key *keys = NULL;
+	size_t capacity = 0;
+	ssize_t len, n;
+	char *chunk;
+
+	/* Records must not be cut by a chunk: */
+	if (job->opts->record_size != 0)
+		size -= size % job->opts->record_size;
+
+	chunk = malloc(size);
+	if (chunk == NULL) {
+		job_fail(job);
+		return NULL;
+	}
+
+	while ((len = job_read(job, chunk, size)) > 0) {
+		n = chunk_sort(job->opts, chunk, len, &keys, &capacity);
+		if (n < 0 || run_write(job, keys, n) < 0)
+			break;
+	}
+	if (len != 0)
+		job_fail(job);
+
+	free(keys);
+	free(chunk);
+	return NULL;
+}
+
+/*
+ * Description: k-way merge with a loser tree: every internal node keeps
+ the loser of the match played there, so replacing the winner takes one
+ comparison per level (log2 k) against the stored losers.
+ */
+struct merge {
+	size_t k;
+	SO_FILE **in;
+	struct so_record *cur; /* current record of every run */
+	int *live; /* 0 once a run is exhausted */
+	size_t *tree; /* tree[0] is the winner, tree[1..k-1] the losers */
+};
+
+#define MERGE_EMPTY SIZE_MAX /* node not played yet, while building */
+
+/*
+ * Description: checks if run a wins against run b; exhausted runs lose.
+ */
+static int merge_less(struct merge *m, size_t a, size_t b)
+{
+	if (!m->live[a] || !m->live[b])
+		return m->live[a];
+
+	return record_cmp(m->cur[a].data, m->cur[a].len,
+			  m->cur[b].data, m->cur[b].len) <= 0;
+}
+
+/*
+ * Description: replays the matches from the leaf of run i to the root.
+ While building, run i stops at the first node not played yet, to wait
+ there for the winner of the other subtree.
+ */
+static void merge_replay(struct merge *m, size_t i)
+{
+	size_t node, winner = i, t;
+
+	for (node = (i + m->k) / 2; node > 0; node /= 2) {
+		if (m->tree[node] == MERGE_EMPTY) {
+			m->tree[node] = winner;
+			return;
+		}
+		if (merge_less(m, m->tree[node], winner)) {
+			t = m->tree[node];
+			m->tree[node] = winner;
+			winner = t;
+		}
+	}
+	m->tree[0] = winner;
+}
+
+/*
+ * Description: advances run i to its next record.
+ * Return: 0/-1 if reading fails.
+ */
+static int merge_next(struct merge *m, size_t i)
+{
+	int rc = so_fread_record(m->in[i], &m->cur[i]);
+
+	m->live[i] = (rc == 1);
+
+	return rc < 0 ? -1 : 0;
+}
+
+/*
+ * Description: builds the tree by replaying every run into an empty one.
+ */
+static void merge_build(struct merge *m)
+{
+	size_t i;
+
+	for (i = 0; i < m->k; i++)
+		m->tree[i] = MERGE_EMPTY;
+	for (i = 0; i < m->k; i++)
+		merge_replay(m, i);
+}
+
+/*
+ * Description: merges k runs into out: as runs (final 0) or in the
+ output format (lines or raw records). The runs are opened together, with
+ their first buffers loaded in one batch (so_fopen_many).
+ * Return: 0/-1 if fails.
+ */
+static int merge_runs(const struct so_sort_opts *opts, char **runs,
+		      size_t k, SO_FILE *out, int final)
+{
+	struct merge m = { .k = k };
+	size_t i, w;
+	int rc = -1;
+
+	m.in = calloc(k, sizeof(*m.in));
+	m.cur = calloc(k, sizeof(*m.cur));
+	m.live = calloc(k, sizeof(*m.live));
+	m.tree = calloc(k, sizeof(*m.tree));
+	if (m.in == NULL || m.cur == NULL || m.live == NULL || m.tree == NULL)
+		goto out;
+
+	if (so_fopen_many((const char * const *) runs, k, m.in) != k)
+		goto out;
+	for (i = 0; i < k; i++) {
+		posix_fadvise(so_fileno(m.in[i]), 0, 0,
+			      POSIX_FADV_SEQUENTIAL);
+		if (merge_next(&m, i) < 0)
+			goto out;
+	}
+	merge_build(&m);
+
+	while (m.live[w = m.tree[0]]) {
+		if (!final) {
+			if (so_fwrite_record(out, m.cur[w].data,
+					     m.cur[w].len) < 0)
+				goto out;
+		} else if (so_fwrite(m.cur[w].data, 1, m.cur[w].len,
+				     out) != m.cur[w].len ||
+			   (opts->record_size == 0 &&
+			    so_fputc('\n', out) == SO_EOF)) {
+			goto out;
+		}
+
+		if (merge_next(&m, w) < 0)
+			goto out;
+		merge_replay(&m, w);
+	}
+	rc = 0;
+
+out:
+	for (i = 0; m.in != NULL && i < k; i++)
+		if (m.in[i] != NULL)
+			so_fclose(m.in[i]);
+	free(m.in);
+	free(m.cur);
+	free(m.live);
+	free(m.tree);
+	return rc;
+}
+
+/*
+ * Description: merges the runs of the job, SORT_FANIN at a time, until
+ one pass can write the output.
+ * Return: 0/-1 if fails.
+ */
+static int merge_all(struct sort_job *job, const char *output)
+{
+	size_t i, k, done = 0;
+	SO_FILE *out;
+	char *name;
+	int rc;
+
+	while (job->nruns - done > SORT_FANIN) {
+		k = SORT_FANIN;
+		out = run_create(job, &name);
+		if (out == NULL)
+			return -1;
+
+		rc = merge_runs(job->opts, job->runs + done, k, out, 0);
+		if (so_fclose(out) != 0 || rc < 0 ||
+		    job_add_run(job, name) < 0) {
+			unlink(name);
+			free(name);
+			return -1;
+		}
+		for (i = done; i < done + k; i++) {
+			unlink(job->runs[i]);
+			free(job->runs[i]);
+			job->runs[i] = NULL;
+		}
+		done += k;
+	}
+
+	out = so_fopen(output, "w");
+	if (out == NULL)
+		return -1;
+	so_setvbuf(out, SORT_RUN_BUFSIZE);
+
+	rc = 0;
+	if (job->nruns > done)
+		rc = merge_runs(job->opts, job->runs + done,
+				job->nruns - done, out, 1);
+	if (so_fclose(out) != 0)
+		rc = -1;
+
+	return rc;
+}
+
+/*
+ * Description: sorts the file input into output, bytewise (as sort with
+ LC_ALL=C), by line or, if opts->record_size is set, by fixed-size
+ record. Sorted runs of opts->memory bytes (split between opts->threads
+ threads, plus an index of 24 bytes per record) are written in parallel
+ to opts->tmpdir, then merged SORT_FANIN at a time with a loser tree. A
+ last line without '\n' gets one. opts may be NULL; zero fields take the
+ defaults (lines, 256 MiB, one thread per CPU, /tmp).
+ * Return: 0/SO_EOF if fails.
+ */
+int so_sort(const char *input, const char *output,
+	    const struct so_sort_opts *opts)
+{
+	struct so_sort_opts o = { 0 };
+	struct sort_job job = { .opts = &o };
+	pthread_t *threads;
+	unsigned int i, started = 0;
+	int rc = SO_EOF;
+
+	if (opts != NULL)
+		o = *opts;
+	if (o.memory == 0)
+		o.memory = SORT_MEMORY;
+	if (o.threads == 0)
+		o.threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ?
+			    sysconf(_SC_NPROCESSORS_ONLN) : 1;
+	if (o.memory / o.threads < 2 * o.record_size + 4096) {
+		errno = EINVAL;
+		return SO_EOF;
+	}
+
+	job.in = so_fopen(input, "r");
+	if (job.in == NULL)
+		return SO_EOF;
+	posix_fadvise(so_fileno(job.in), 0, 0, POSIX_FADV_SEQUENTIAL);
+	job.carry = malloc(o.memory / o.threads);
+	threads = calloc(o.threads, sizeof(*threads));
+	pthread_mutex_init(&job.lock, NULL);
+	if (job.carry == NULL || threads == NULL)
+		goto out;
+
+	for (i = 0; i < o.threads; i++)
+		if (pthread_create(&threads[i], NULL, run_thread, &job) == 0)
+			started++;
+		else
+			break;
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	if (started == 0 || job.failed) {
+		errno = started == 0 ? EAGAIN : job.err;
+		goto out;
+	}
+	if (merge_all(&job, output) == 0)
+		rc = 0;
+
+out:
+	for (i = 0; i < job.nruns; i++) {
+		if (job.runs[i] != NULL)
+			unlink(job.runs[i]);
+		free(job.runs[i]);
+	}
+	free(job.runs);
+	free(threads);
+	free(job.carry);
+	pthread_mutex_destroy(&job.lock);
+	so_fclose(job.in);
+
+	return rc;
+}
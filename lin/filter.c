@@ -0,0 +1,519 @@
+#include <pthread.h>
+
+#include "utils.h"
+#include "filter.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FILTER_X86
+#endif
+
+/*
+ * Structure for the filter state of a stream. A UTF-8 sequence and a CR
+ may end a buffer, so what they expect from the next one is kept here.
+ */
+struct filter {
+	int flags; /* SO_FILTER_* */
+	off_t offset; /* file offset of the next byte loaded */
+	long long bad; /* file offset of the invalid sequence, -1 if none */
+
+	int need; /* continuation bytes the current sequence still needs */
+	unsigned char lo, hi; /* range of the next continuation byte */
+	off_t lead; /* file offset of the lead byte of the sequence */
+
+	int skip_lf; /* the buffer ended with a CR, drop a leading LF */
+	int *removed; /* buffer offsets of the LFs dropped after a CR */
+	int nremoved;
+	int capacity;
+};
+
+/*
+ * Description: validates bytes [i, n) of the buffer as UTF-8 (Unicode
+ Table 3-7: no overlong forms, surrogates or values above U+10FFFF),
+ continuing the sequence left open before i. ASCII is skipped a word at a
+ time.
+ * Return: 0/-1 if a sequence is invalid, its lead byte being at file
+ offset f->lead.
+ */
+static int utf8_scalar(struct filter *f, const unsigned char *p, long i,
+		       long n)
+{
+	uint64_t w;
+	int c;
+
+	for (; i < n; i++) {
+		c = p[i];
+		if (f->need != 0) {
+			if (c < f->lo || c > f->hi)
+				return -1;
+			f->lo = 0x80;
+			f->hi = 0xbf;
+			f->need--;
+			continue;
+		}
+
+		if (c < 0x80) {
+			while (i + 8 < n) {
+				memcpy(&w, p + i + 1, 8);
+				if (w & 0x8080808080808080ULL)
+					break;
+				i += 8;
+			}
+			continue;
+		}
+
+		f->lead = f->offset + i;
+		f->lo = 0x80;
+		f->hi = 0xbf;
+		if (c < 0xc2) {
+			return -1;
+		} else if (c < 0xe0) {
+			f->need = 1;
+		} else if (c < 0xf0) {
+			f->need = 2;
+			if (c == 0xe0)
+				f->lo = 0xa0;
+			else if (c == 0xed)
+				f->hi = 0x9f;
+		} else if (c < 0xf5) {
+			f->need = 3;
+			if (c == 0xf0)
+				f->lo = 0x90;
+			else if (c == 0xf4)
+				f->hi = 0x8f;
+		} else {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Description: finds where a scalar pass may take over at i (but not
+ before start): the lead byte of a sequence that starts in the 3 bytes
+ before i and is not finished by then, else i itself.
+ */
+static long utf8_boundary(const unsigned char *p, long start, long i)
+{
+	long j;
+	int len;
+
+	for (j = i - 1; j >= start && j >= i - 3; j--) {
+		if (p[j] < 0x80)
+			break;
+		if (p[j] >= 0xc0) {
+			len = p[j] < 0xe0 ? 2 : (p[j] < 0xf0 ? 3 : 4);
+			return j + len > i ? j : i;
+		}
+	}
+
+	return i;
+}
+
+#ifdef FILTER_X86
+/*
+ * The AVX2 kernel is the lookup algorithm of Keiser and Lemire
+ ("Validating UTF-8 In Less Than One Instruction Per Byte"): three table
+ lookups on the nibbles of each byte and of the byte before it classify
+ every two-byte pattern, and the bytes that must be the 3rd or 4th of a
+ sequence are found from the bytes 2 and 3 positions back.
+ */
+#define TOO_SHORT (1 << 0)
+#define TOO_LONG (1 << 1)
+#define OVERLONG_3 (1 << 2)
+#define TOO_LARGE (1 << 3)
+#define SURROGATE (1 << 4)
+#define OVERLONG_2 (1 << 5)
+#define TOO_LARGE_1000 (1 << 6)
+#define OVERLONG_4 (1 << 6)
+#define TWO_CONTS ((char) (1 << 7))
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#define TABLE16(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+
+__attribute__((target("avx2")))
+static inline __m256i nibble_hi(__m256i v)
+{
+	return _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0f));
+}
+
+/*
+ * Description: the bytes of v shifted by n positions, taking the first
+ ones from the end of prev.
+ */
+#define PREV(v, prev, n)						\
+	_mm256_alignr_epi8(v, _mm256_permute2x128_si256(prev, v, 0x21), 16 - (n))
+
+/*
+ * Description: error bits of a 32 byte block, given the block before it.
+ */
+__attribute__((target("avx2")))
+static __m256i utf8_block_avx2(__m256i v, __m256i prev)
+{
+	const __m256i byte_1_high_tbl = TABLE16(
+		TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+		TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+		TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+		TOO_SHORT | OVERLONG_2,
+		TOO_SHORT,
+		TOO_SHORT | OVERLONG_3 | SURROGATE,
+		TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+	const __m256i byte_1_low_tbl = TABLE16(
+		CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+		CARRY | OVERLONG_2,
+		CARRY,
+		CARRY,
+		CARRY | TOO_LARGE,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+		CARRY | TOO_LARGE | TOO_LARGE_1000,
+		CARRY | TOO_LARGE | TOO_LARGE_1000);
+	const __m256i byte_2_high_tbl = TABLE16(
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 |
+		TOO_LARGE_1000 | OVERLONG_4,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+		TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+		TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+	__m256i prev1 = PREV(v, prev, 1);
+	__m256i special, must23;
+
+	special = _mm256_and_si256(
+		_mm256_and_si256(
+			_mm256_shuffle_epi8(byte_1_high_tbl, nibble_hi(prev1)),
+			_mm256_shuffle_epi8(byte_1_low_tbl,
+					    _mm256_and_si256(prev1,
+						_mm256_set1_epi8(0x0f)))),
+		_mm256_shuffle_epi8(byte_2_high_tbl, nibble_hi(v)));
+
+	/* Only 111_____ two back and 1111____ three back give bit 7: */
+	must23 = _mm256_or_si256(
+		_mm256_subs_epu8(PREV(v, prev, 2), _mm256_set1_epi8(0xe0 - 0x80)),
+		_mm256_subs_epu8(PREV(v, prev, 3), _mm256_set1_epi8(0xf0 - 0x80)));
+	must23 = _mm256_and_si256(must23, _mm256_set1_epi8((char) 0x80));
+
+	return _mm256_xor_si256(must23, special);
+}
+
+/*
+ * Description: validates whole 32 byte blocks from p, starting at a
+ sequence boundary.
+ * Return: offset of the first block with an error (or the block after
+ an unfinished sequence)/offset after the last block checked.
+ */
+__attribute__((target("avx2")))
+static long utf8_avx2(const unsigned char *p, long n)
+{
+	/* Bytes that start a sequence too long for the end of a block: */
+	const __m256i max = _mm256_setr_epi8(
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		(char) (0xf0 - 1), (char) (0xe0 - 1), (char) (0xc0 - 1));
+	__m256i v, err, prev = _mm256_setzero_si256();
+	__m256i incomplete = _mm256_setzero_si256();
+	long i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *) (p + i));
+		if (_mm256_movemask_epi8(v) == 0) {
+			if (!_mm256_testz_si256(incomplete, incomplete))
+				return i;
+		} else {
+			err = utf8_block_avx2(v, prev);
+			if (!_mm256_testz_si256(err, err))
+				return i;
+			incomplete = _mm256_subs_epu8(v, max);
+		}
+		prev = v;
+	}
+
+	return i;
+}
+#endif
+
+static pthread_once_t avx2_once = PTHREAD_ONCE_INIT;
+static int have_avx2;
+
+static void avx2_init(void)
+{
+#ifdef FILTER_X86
+	__builtin_cpu_init();
+	have_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+/*
+ * Description: validates n bytes, continuing the state of the previous
+ buffer. The vector kernel skips the blocks it finds valid; the scalar
+ loop handles the start and end of the buffer and pins down errors.
+ * Return: index of the lead byte of the first invalid sequence (negative
+ if it started in an earlier buffer)/n if every byte is valid.
+ */
+static long utf8_validate(struct filter *f, const unsigned char *p, long n)
+{
+	long i = 0, done;
+
+	/* Finish the sequence left open by the previous buffer: */
+	while (i < n && f->need != 0) {
+		if (p[i] < f->lo || p[i] > f->hi)
+			return f->lead - f->offset;
+		f->lo = 0x80;
+		f->hi = 0xbf;
+		f->need--;
+		i++;
+	}
+
+#ifdef FILTER_X86
+	if (have_avx2) {
+		done = i + utf8_avx2(p + i, n - i);
+		i = utf8_boundary(p, i, done);
+	}
+#endif
+
+	if (utf8_scalar(f, p, i, n) < 0)
+		return f->lead - f->offset;
+
+	return n;
+}
+
+/*
+ * Description: turns CRLF and lone CRs into LF in the n bytes at p,
+ recording where LFs were dropped.
+ * Return: new length/-1 if memory allocation fails.
+ */
+static long crlf_normalize(struct filter *f, char *p, long n)
+{
+	char *out = p, *cr, *end = p + n;
+	int *removed;
+
+	f->nremoved = 0;
+	if (f->skip_lf && n > 0 && *p == '\n') {
+		p++;
+		f->nremoved = 1;
+		f->removed[0] = 0;
+	}
+	f->skip_lf = 0;
+
+	while ((cr = memchr(p, '\r', end - p)) != NULL) {
+		memmove(out, p, cr - p);
+		out += cr - p;
+		*out++ = '\n';
+		p = cr + 1;
+
+		if (p == end) {
+			f->skip_lf = 1;
+			break;
+		}
+		if (*p != '\n')
+			continue;
+
+		p++;
+		if (f->nremoved == f->capacity) {
+			removed = realloc(f->removed,
+					  2 * f->capacity * sizeof(int));
+			if (removed == NULL)
+				return -1;
+			f->removed = removed;
+			f->capacity *= 2;
+		}
+		f->removed[f->nremoved++] = out - 1 - (end - n);
+	}
+
+	memmove(out, p, end - p);
+	out += end - p;
+
+	return out - (end - n);
+}
+
+/*
+ * Description: marks the stream as failed, with the invalid sequence at
+ file offset bad.
+ * Return: -1.
+ */
+static int filter_fail(SO_FILE *stream, long long bad)
+{
+	stream->filter->bad = bad;
+	stream->rerror = SO_EOF;
+	stream->roffset = 0;
+	stream->rsize = 0;
+	errno = EILSEQ;
+
+	return -1;
+}
+
+/*
+ * Description: filters a freshly loaded read buffer. If an invalid
+ sequence is found, the bytes before it are kept and the next load fails
+ with EILSEQ; so_ferroroffset gives the offset.
+ * Return: bytes left in the buffer/0 at EOF/-1 if fails, with errno
+ EAGAIN if all that was read got dropped (the buffer must be loaded
+ again).
+ */
+int filter_loaded(SO_FILE *stream, int bytes_read)
+{
+	struct filter *f = stream->filter;
+	long n = bytes_read, bad;
+
+	if (f->bad >= 0)
+		return filter_fail(stream, f->bad);
+	if (bytes_read < 0)
+		return bytes_read;
+	if (bytes_read == 0) {
+		/* The file ended inside a sequence: */
+		if (f->need != 0)
+			return filter_fail(stream, f->lead);
+		return 0;
+	}
+
+	if (f->flags & SO_FILTER_UTF8) {
+		bad = utf8_validate(f, (unsigned char *) stream->rbuffer, n);
+		if (bad < n) {
+			if (bad <= 0)
+				return filter_fail(stream, f->offset + bad);
+			f->bad = f->offset + bad;
+			n = bad;
+		}
+	}
+	f->offset += bytes_read;
+
+	if (f->flags & SO_FILTER_CRLF) {
+		n = crlf_normalize(f, stream->rbuffer, n);
+		if (n < 0) {
+			stream->rerror = SO_EOF;
+			return -1;
+		}
+	}
+
+	stream->rsize = n;
+	/* A lone LF was dropped, this is not EOF: */
+	if (n == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return n;
+}
+
+/*
+ * Description: counts the bytes read from the file for the read buffer
+ but dropped from it, past roffset.
+ */
+long filter_ahead(SO_FILE *stream)
+{
+	struct filter *f = stream->filter;
+	int lo = 0, hi, mid;
+
+	if (f == NULL || stream->rsize == 0)
+		return 0;
+
+	/* Binary search for the first drop at or after roffset: */
+	hi = f->nremoved;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (f->removed[mid] < stream->roffset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return f->nremoved - lo;
+}
+
+/*
+ * Description: forgets the state carried between buffers after a seek
+ to offset (-1 if not known).
+ */
+void filter_reset(SO_FILE *stream, off_t offset)
+{
+	struct filter *f = stream->filter;
+
+	if (f == NULL)
+		return;
+
+	if (offset >= 0)
+		f->offset = offset;
+	f->need = 0;
+	f->skip_lf = 0;
+	f->nremoved = 0;
+}
+
+/*
+ * Description: frees the filter state of a stream.
+ */
+void filter_free(SO_FILE *stream)
+{
+	if (stream->filter == NULL)
+		return;
+
+	free(stream->filter->removed);
+	free(stream->filter);
+	stream->filter = NULL;
+}
+
+/*
+ * Description: sets the filters applied to every read buffer as soon as
+ it is loaded: SO_FILTER_UTF8 validates the data as UTF-8, SO_FILTER_CRLF
+ turns CRLF and lone CR line endings into LF. Data after an invalid
+ sequence is not returned; reading then fails with EILSEQ, so_ferror is
+ set and so_ferroroffset gives the file offset of the sequence. Offsets
+ of so_ftell/so_fseek stay those of the file. Must be called before
+ anything is read; 0 turns the filters off.
+ * Return: 0/SO_EOF if fails.
+ */
+int so_fsetfilter(SO_FILE *stream, int flags)
+{
+	struct filter *f;
+	off_t offset;
+
+	if (stream->direct || stream->roffset != stream->rsize ||
+	    (flags & ~(SO_FILTER_UTF8 | SO_FILTER_CRLF))) {
+		errno = EINVAL;
+		return SO_EOF;
+	}
+
+	filter_free(stream);
+	if (flags == 0)
+		return 0;
+
+	f = calloc(1, sizeof(*f));
+	if (f != NULL)
+		f->removed = malloc(64 * sizeof(int));
+	if (f == NULL || f->removed == NULL) {
+		free(f);
+		return SO_EOF;
+	}
+	f->capacity = 64;
+	f->flags = flags;
+	f->bad = -1;
+	pthread_once(&avx2_once, avx2_init);
+
+	/* Pipes have no offset, theirs start at 0: */
+	offset = stream_lseek(stream, 0, SEEK_CUR);
+	f->offset = offset < 0 ? 0 : offset;
+	stream->filter = f;
+
+	return 0;
+}
+
+/*
+ * Description: gives the file offset of the invalid UTF-8 sequence that
+ stopped a filtered stream (see so_fsetfilter).
+ * Return: offset/-1 if there is none.
+ */
+long long so_ferroroffset(SO_FILE *stream)
+{
+	if (stream->filter == NULL)
+		return -1;
+
+	return stream->filter->bad;
+}
@@ -0,0 +1,18 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include "so_file.h"
+
+/*
+ * Input filter (so_fsetfilter): every loaded read buffer is validated as
+ UTF-8 and/or has its line endings normalized before it is used. Removing
+ bytes makes the buffer shorter than the data read, so so_ftell and
+ so_fseek ask filter_ahead for the difference.
+ */
+
+int filter_loaded(SO_FILE *stream, int bytes_read);
+long filter_ahead(SO_FILE *stream);
+void filter_reset(SO_FILE *stream, off_t offset);
+void filter_free(SO_FILE *stream);
+
+#endif
@@ -0,0 +1,219 @@
+#include <libgen.h>
+#include <poll.h>
+#include <sys/inotify.h>
+
+#include "utils.h"
+#include "follow.h"
+
+#define FOLLOW_FILE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | \
+			    IN_DELETE_SELF)
+#define FOLLOW_DIR_EVENTS (IN_CREATE | IN_MOVED_TO)
+
+/*
+ * Structure for the follow state of a stream. The file is watched for new
+ data and for being moved or deleted; its directory is watched for a new
+ file taking its name (rotation).
+ */
+struct follow {
+	int ifd; /* inotify instance, non-blocking */
+	int file_wd; /* watch of the file, -1 if it does not exist */
+	int dir_wd; /* watch of its directory */
+};
+
+/*
+ * Description: (re)adds the watch of the file currently at the path.
+ */
+static void watch_file(SO_FILE *stream)
+{
+	struct follow *fol = stream->follow;
+
+	if (fol->file_wd >= 0)
+		inotify_rm_watch(fol->ifd, fol->file_wd);
+	fol->file_wd = inotify_add_watch(fol->ifd, stream->pathname,
+					 FOLLOW_FILE_EVENTS);
+}
+
+/*
+ * Description: discards the queued events. They only tell that something
+ changed, what changed is checked by follow_check.
+ */
+static void drain_events(struct follow *fol)
+{
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+
+	while (read(fol->ifd, buf, sizeof(buf)) > 0)
+		;
+}
+
+/*
+ * Description: handles the changes that a read would not notice: if the
+ path now names another file (rotation), that file is opened in place of
+ the old one and read from its start, once the old one was read to its
+ end (as tail -F does, so bytes appended to it before the switch are not
+ lost); if the file was truncated below the current offset, reading
+ restarts from its start.
+ * Return: 0/-1 if fails.
+ */
+static int follow_check(SO_FILE *stream)
+{
+	struct stat path_st, fd_st;
+	off_t off;
+	int fd;
+
+	if (fstat(stream->fd, &fd_st) < 0)
+		return -1;
+
+	off = lseek(stream->fd, 0, SEEK_CUR);
+	if (off < 0)
+		return -1;
+
+	/* The old file grew: read it first, the next check switches. */
+	if (off < fd_st.st_size)
+		return 0;
+
+	if (stat(stream->pathname, &path_st) == 0 &&
+	    (path_st.st_dev != fd_st.st_dev ||
+	     path_st.st_ino != fd_st.st_ino)) {
+		fd = open(stream->pathname, stream->flags |
+			  (stream->nonblock ? O_NONBLOCK : 0));
+		if (fd < 0)
+			return errno == ENOENT ? 0 : -1;
+
+		/* Keep the descriptor number that so_fileno returned: */
+		if (dup2(fd, stream->fd) < 0) {
+			close(fd);
+			return -1;
+		}
+		close(fd);
+		watch_file(stream);
+		return 0;
+	}
+
+	if (off > fd_st.st_size && lseek(stream->fd, 0, SEEK_SET) < 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Description: called once a read of a followed stream returned 0. Waits
+ for the file to grow, be truncated or be replaced, then reads up to count
+ bytes. A non-blocking stream does not wait: it fails with EAGAIN and the
+ caller may poll the descriptor returned by so_ffollow_fd.
+ * Return: number of bytes read/-1 if fails.
+ */
+ssize_t follow_wait(SO_FILE *stream, void *buf, size_t count)
+{
+	struct follow *fol = stream->follow;
+	struct pollfd pfd = { .fd = fol->ifd, .events = POLLIN };
+	unsigned long long start;
+	ssize_t rc;
+
+	for (;;) {
+		drain_events(fol);
+		if (follow_check(stream) < 0)
+			return -1;
+
+		rc = stream_read(stream, buf, count);
+		if (rc != 0)
+			return rc;
+
+		if (stream->nonblock) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+		start = now_ns();
+		rc = poll(&pfd, 1, -1);
+		stats_syscalls(stream, 1, start);
+		if (rc < 0 && errno != EINTR)
+			return -1;
+	}
+}
+
+/*
+ * Description: frees the follow state of a stream.
+ */
+void follow_free(SO_FILE *stream)
+{
+	struct follow *fol = stream->follow;
+
+	if (fol == NULL)
+		return;
+
+	close(fol->ifd);
+	free(fol);
+	stream->follow = NULL;
+}
+
+/*
+ * Description: turns follow mode on or off for a file opened with "r".
+ In follow mode reaching the end of the file is not an EOF: reads wait
+ (using inotify, without polling) until data is appended, restart from
+ the beginning if the file is truncated and switch to the new file if the
+ path is rotated to another file, like tail -F. Large so_fread calls are
+ then served through the buffer.
+ * Return: 0/SO_EOF if fails.
+ */
+int so_ffollow(SO_FILE *stream, int on)
+{
+	struct follow *fol;
+	char *dir;
+
+	if (!on) {
+		follow_free(stream);
+		return 0;
+	}
+
+	if (stream->pathname == NULL || stream->direct ||
+	    (stream->flags & O_ACCMODE) != O_RDONLY) {
+		errno = EINVAL;
+		return SO_EOF;
+	}
+	if (stream->follow != NULL)
+		return 0;
+
+	fol = malloc(sizeof(*fol));
+	dir = strdup(stream->pathname);
+	if (fol == NULL || dir == NULL)
+		goto fail;
+
+	fol->file_wd = -1;
+	fol->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fol->ifd < 0)
+		goto fail;
+	fol->dir_wd = inotify_add_watch(fol->ifd, dirname(dir),
+					FOLLOW_DIR_EVENTS);
+	if (fol->dir_wd < 0) {
+		close(fol->ifd);
+		goto fail;
+	}
+	free(dir);
+
+	stream->follow = fol;
+	watch_file(stream);
+	stream->rerror = 0;
+
+	return 0;
+
+fail:
+	free(dir);
+	free(fol);
+	return SO_EOF;
+}
+
+/*
+ * Description: descriptor that becomes readable when a followed stream
+ may have new data, for poll/epoll loops over non-blocking streams.
+ * Return: descriptor/-1 if the stream is not in follow mode.
+ */
+int so_ffollow_fd(SO_FILE *stream)
+{
+	if (stream->follow == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return stream->follow->ifd;
+}
@@ -0,0 +1,14 @@
+#ifndef FOLLOW_H
+#define FOLLOW_H
+
+#include "so_file.h"
+
+/*
+ * Follow mode (so_ffollow). load_rbuffer calls follow_wait instead of
+ reporting EOF, so_fclose calls follow_free.
+ */
+
+ssize_t follow_wait(SO_FILE *stream, void *buf, size_t count);
+void follow_free(SO_FILE *stream);
+
+#endif
@@ -0,0 +1,371 @@
+#include <stdio.h>
+#include <pthread.h>
+
+#include "utils.h"
+#include "lineindex.h"
+
+#define LINEINDEX_EVERY 1024 /* default number of lines between entries */
+#define LINEINDEX_CHUNK (1 << 20) /* bytes scanned per read */
+#define LINEINDEX_SUFFIX ".soidx"
+
+static const char lineindex_magic[8] = "SOIDX1";
+
+/*
+ * Structure for the header of an index file. It is followed by count
+ offsets, the first being 0; the index is only used if the size and
+ modification time still match the file.
+ */
+struct lineindex_header {
+	char magic[8];
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint32_t every;
+	uint32_t reserved;
+	uint64_t count;
+};
+
+/*
+ * Structure for the index of a stream: offsets[k] is where line k * every
+ starts. While the builder thread runs, offsets grows under the lock and
+ so_fseekline uses the entries found so far.
+ */
+struct line_index {
+	unsigned int every;
+	pthread_mutex_t lock;
+	uint64_t *offsets;
+	size_t count;
+	size_t capacity;
+
+	pthread_t thread;
+	int running; /* 1 while the builder thread must be joined */
+	int cancel; /* asks the builder thread to stop */
+
+	char *pathname; /* of the indexed file */
+	struct stat st; /* of the file when the scan started */
+};
+
+/*
+ * Description: appends offsets to the index.
+ * Return: 0/-1 if memory allocation fails.
+ */
+static int index_append(struct line_index *idx, const uint64_t *offsets,
+			size_t count)
+{
+	uint64_t *p;
+	size_t capacity;
+	int rc = 0;
+
+	pthread_mutex_lock(&idx->lock);
+
+	if (idx->count + count > idx->capacity) {
+		capacity = idx->capacity ? idx->capacity : 1024;
+		while (capacity < idx->count + count)
+			capacity *= 2;
+		p = realloc(idx->offsets, capacity * sizeof(*p));
+		if (p == NULL) {
+			rc = -1;
+			goto out;
+		}
+		idx->offsets = p;
+		idx->capacity = capacity;
+	}
+
+	memcpy(idx->offsets + idx->count, offsets, count * sizeof(*offsets));
+	idx->count += count;
+
+out:
+	pthread_mutex_unlock(&idx->lock);
+	return rc;
+}
+
+/*
+ * Description: builds the name of the index file of pathname.
+ * Return: name (to be freed)/NULL if memory allocation fails.
+ */
+static char *index_pathname(const char *pathname, const char *suffix)
+{
+	size_t len = strlen(pathname);
+	char *name = malloc(len + strlen(suffix) + 1);
+
+	if (name != NULL) {
+		memcpy(name, pathname, len);
+		strcpy(name + len, suffix);
+	}
+
+	return name;
+}
+
+/*
+ * Description: loads the index file, if it matches the file and the
+ number of lines between entries.
+ * Return: 0/-1 if there is no usable index file.
+ */
+static int index_load(struct line_index *idx)
+{
+	struct lineindex_header hdr;
+	uint64_t *offsets = NULL;
+	char *name;
+	int fd, rc = -1;
+	size_t len;
+
+	name = index_pathname(idx->pathname, LINEINDEX_SUFFIX);
+	if (name == NULL)
+		return -1;
+	fd = open(name, O_RDONLY);
+	free(name);
+	if (fd < 0)
+		return -1;
+
+	if (xread(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    memcmp(hdr.magic, lineindex_magic, sizeof(hdr.magic)) != 0 ||
+	    hdr.size != (uint64_t) idx->st.st_size ||
+	    hdr.mtime_sec != idx->st.st_mtim.tv_sec ||
+	    hdr.mtime_nsec != idx->st.st_mtim.tv_nsec ||
+	    hdr.every != idx->every || hdr.count == 0 ||
+	    hdr.count > hdr.size / idx->every + 1)
+		goto out;
+
+	len = hdr.count * sizeof(*offsets);
+	offsets = malloc(len);
+	if (offsets == NULL || xread(fd, offsets, len) != (ssize_t) len)
+		goto out;
+
+	rc = index_append(idx, offsets, hdr.count);
+
+out:
+	free(offsets);
+	close(fd);
+	return rc;
+}
+
+/*
+ * Description: writes the index next to the file, through a temporary
+ file renamed over the old index. Failing to do so (e.g. read-only
+ directory) only means the index is built again next time.
+ */
+static void index_save(struct line_index *idx)
+{
+	struct lineindex_header hdr;
+	char *name, *tmp, suffix[32];
+	int fd, rc;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, lineindex_magic, sizeof(hdr.magic));
+	hdr.size = idx->st.st_size;
+	hdr.mtime_sec = idx->st.st_mtim.tv_sec;
+	hdr.mtime_nsec = idx->st.st_mtim.tv_nsec;
+	hdr.every = idx->every;
+	hdr.count = idx->count;
+
+	snprintf(suffix, sizeof(suffix), LINEINDEX_SUFFIX ".%d", getpid());
+	name = index_pathname(idx->pathname, LINEINDEX_SUFFIX);
+	tmp = index_pathname(idx->pathname, suffix);
+	if (name == NULL || tmp == NULL)
+		goto out;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto out;
+	rc = xwrite(fd, &hdr, sizeof(hdr), NULL);
+	if (rc >= 0)
+		rc = xwrite(fd, idx->offsets, idx->count * sizeof(uint64_t),
+			    NULL);
+	if (close(fd) < 0 || rc < 0 || rename(tmp, name) < 0)
+		unlink(tmp);
+
+out:
+	free(tmp);
+	free(name);
+}
+
+/*
+ * Description: scans the file for line starts, then saves the index if
+ the file did not change meanwhile. Reads through its own file
+ descriptor, so the position of the stream is not touched.
+ * Return: 0/-1 if fails.
+ */
+static int index_build(struct line_index *idx)
+{
+	uint64_t found[256], line = 0, pos = 0;
+	size_t nfound = 0;
+	ssize_t len;
+	struct stat st;
+	char *buf, *p, *end;
+	int fd, rc = -1;
+
+	fd = open(idx->pathname, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	buf = malloc(LINEINDEX_CHUNK);
+	if (buf == NULL)
+		goto out;
+
+	found[nfound++] = 0;
+	while (pos < (uint64_t) idx->st.st_size &&
+	       !__atomic_load_n(&idx->cancel, __ATOMIC_RELAXED)) {
+		len = xread(fd, buf, LINEINDEX_CHUNK);
+		if (len < 0)
+			goto out;
+		if (len == 0)
+			break;
+
+		for (p = buf, end = buf + len;
+		     (p = memchr(p, '\n', end - p)) != NULL; p++) {
+			if (++line % idx->every != 0)
+				continue;
+			found[nfound++] = pos + (p - buf) + 1;
+			if (nfound == sizeof(found) / sizeof(*found)) {
+				if (index_append(idx, found, nfound) < 0)
+					goto out;
+				nfound = 0;
+			}
+		}
+		pos += len;
+	}
+
+	if (index_append(idx, found, nfound) < 0)
+		goto out;
+	rc = 0;
+
+	if (!idx->cancel && fstat(fd, &st) == 0 &&
+	    st.st_size == idx->st.st_size &&
+	    st.st_mtim.tv_sec == idx->st.st_mtim.tv_sec &&
+	    st.st_mtim.tv_nsec == idx->st.st_mtim.tv_nsec)
+		index_save(idx);
+
+out:
+	free(buf);
+	close(fd);
+	return rc;
+}
+
+static void *index_thread(void *arg)
+{
+	index_build(arg);
+	return NULL;
+}
+
+/*
+ * Description: frees the index of a stream, stopping its builder thread.
+ */
+void lineindex_free(SO_FILE *stream)
+{
+	struct line_index *idx = stream->lindex;
+
+	if (idx == NULL)
+		return;
+
+	if (idx->running) {
+		__atomic_store_n(&idx->cancel, 1, __ATOMIC_RELAXED);
+		pthread_join(idx->thread, NULL);
+	}
+	pthread_mutex_destroy(&idx->lock);
+	free(idx->offsets);
+	free(idx->pathname);
+	free(idx);
+	stream->lindex = NULL;
+}
+
+/*
+ * Description: indexes the start of every every-th line of the file (1024
+ if every is 0). An up to date index saved next to the file (pathname
+ followed by ".soidx") is loaded; otherwise the file is scanned and the
+ index is saved. With background set, the scan runs in a separate thread
+ and so_fseekline uses the part of the index built so far. Only streams
+ opened from a path are supported.
+ * Return: 0/SO_EOF if fails.
+ */
+int so_findex(SO_FILE *stream, unsigned int every, int background)
+{
+	struct line_index *idx;
+
+	if (stream->pathname == NULL) {
+		errno = EINVAL;
+		return SO_EOF;
+	}
+
+	idx = calloc(1, sizeof(*idx));
+	if (idx == NULL)
+		return SO_EOF;
+	idx->every = every ? every : LINEINDEX_EVERY;
+	idx->pathname = strdup(stream->pathname);
+	pthread_mutex_init(&idx->lock, NULL);
+	if (idx->pathname == NULL || stat(idx->pathname, &idx->st) < 0)
+		goto fail;
+
+	if (index_load(idx) == 0)
+		goto done;
+
+	if (background) {
+		if (pthread_create(&idx->thread, NULL, index_thread, idx) != 0)
+			goto fail;
+		idx->running = 1;
+	} else if (index_build(idx) < 0) {
+		goto fail;
+	}
+
+done:
+	lineindex_free(stream);
+	stream->lindex = idx;
+	return 0;
+
+fail:
+	pthread_mutex_destroy(&idx->lock);
+	free(idx->offsets);
+	free(idx->pathname);
+	free(idx);
+	return SO_EOF;
+}
+
+/*
+ * Description: moves the cursor to the start of line (counted from 0): a
+ seek to the closest indexed line before it, then a scan of the buffer
+ for the remaining newlines. Without an index, the scan starts at the
+ beginning of the file.
+ * Return: 0/SO_EOF if fails or the file has fewer lines.
+ */
+int so_fseekline(SO_FILE *stream, unsigned long long line)
+{
+	struct line_index *idx = stream->lindex;
+	unsigned long long skip = line;
+	uint64_t offset = 0;
+	size_t k;
+	char *p;
+
+	if (idx != NULL) {
+		pthread_mutex_lock(&idx->lock);
+		k = line / idx->every;
+		if (k >= idx->count && idx->count != 0)
+			k = idx->count - 1;
+		if (idx->count != 0) {
+			offset = idx->offsets[k];
+			skip = line - (unsigned long long) k * idx->every;
+		}
+		pthread_mutex_unlock(&idx->lock);
+	}
+
+	if (offset > LONG_MAX) {
+		errno = EOVERFLOW;
+		return SO_EOF;
+	}
+	if (so_fseek(stream, offset, SEEK_SET) < 0)
+		return SO_EOF;
+
+	while (skip > 0) {
+		if (stream->roffset == stream->rsize &&
+		    load_rbuffer(stream) <= 0)
+			return SO_EOF;
+
+		p = memchr(stream->rbuffer + stream->roffset, '\n',
+			   stream->rsize - stream->roffset);
+		if (p == NULL) {
+			stream->roffset = stream->rsize;
+			continue;
+		}
+		stream->roffset = p - stream->rbuffer + 1;
+		skip--;
+	}
+
+	return 0;
+}
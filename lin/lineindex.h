@@ -0,0 +1,14 @@
+#ifndef LINEINDEX_H
+#define LINEINDEX_H
+
+#include "so_file.h"
+
+/*
+ * Sparse index of line starts (so_findex, so_fseekline). The stream keeps
+ its pathname to build the index from its own file descriptor and to
+ persist it next to the file.
+ */
+
+void lineindex_free(SO_FILE *stream);
+
+#endif
@@ -0,0 +1,253 @@
+#include <pthread.h>
+
+#include "utils.h"
+#include "so_file.h"
+#include "uring.h"
+#include "registry.h"
+
+#define MANY_BATCH 256 /* files opened and read per io_uring round trip */
+#define MANY_THREADS 8 /* threads used without io_uring */
+
+/*
+ * Structure for the files handled by the fallback threads, which take
+ them in order.
+ */
+struct many_job {
+	const char * const *paths;
+	SO_FILE **streams;
+	size_t n;
+	size_t next; /* next file to take */
+};
+
+/*
+ * Description: opens a file and loads its first buffer, the way the batch
+ does it with io_uring.
+ * Return: stream/NULL if fails.
+ */
+static SO_FILE *open_one(const char *path)
+{
+	SO_FILE *stream = so_fopen(path, "r");
+
+	if (stream != NULL)
+		load_rbuffer(stream);
+
+	return stream;
+}
+
+static void *many_thread(void *arg)
+{
+	struct many_job *job = arg;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+	       job->n)
+		job->streams[i] = open_one(job->paths[i]);
+
+	return NULL;
+}
+
+/*
+ * Description: opens the files with a few threads, each doing so_fopen
+ and the first load_rbuffer.
+ */
+static void many_threads(const char * const *paths, size_t n,
+			 SO_FILE **streams)
+{
+	struct many_job job = { paths, streams, n, 0 };
+	pthread_t threads[MANY_THREADS];
+	int i, nthreads = 0;
+
+	for (i = 0; i < MANY_THREADS && (size_t) i + 1 < n; i++)
+		if (pthread_create(&threads[i], NULL, many_thread, &job) == 0)
+			nthreads++;
+		else
+			break;
+
+	/* The calling thread helps (and does it all if none started): */
+	many_thread(&job);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+}
+
+typedef void (*many_fn)(SO_FILE **streams, const char * const *paths,
+			size_t i, int res);
+
+/*
+ * Description: waits for *count completions; fn is called for each, with
+ the index of the file in user_data and the result. *count is left with
+ the requests not completed yet.
+ * Return: 0/-1 if the ring fails.
+ */
+static int many_wait(struct uring *ring, unsigned int *count, many_fn fn,
+		     SO_FILE **streams, const char * const *paths)
+{
+	struct io_uring_cqe *cqe;
+
+	if (uring_submit_wait(ring, *count) < 0)
+		return -1;
+
+	while (*count > 0) {
+		cqe = uring_cqe(ring);
+		if (cqe == NULL) {
+			if (uring_submit_wait(ring, 1) < 0)
+				return -1;
+			continue;
+		}
+		fn(streams, paths, cqe->user_data, cqe->res);
+		uring_cqe_seen(ring);
+		(*count)--;
+	}
+
+	return 0;
+}
+
+static void opened(SO_FILE **streams, const char * const *paths, size_t i,
+		   int res)
+{
+	SO_FILE *stream = streams[i];
+
+	if (res >= 0) {
+		stream->fd = res;
+		return;
+	}
+
+	free_stream(stream);
+	streams[i] = NULL;
+
+	/* Old kernels lack IORING_OP_OPENAT: */
+	if (res == -EINVAL || res == -EOPNOTSUPP)
+		streams[i] = open_one(paths[i]);
+	else
+		errno = -res;
+}
+
+static void primed(SO_FILE **streams, const char * const *paths, size_t i,
+		   int res)
+{
+	so_rbuffer_commit(streams[i], res);
+}
+
+/*
+ * Description: opens and reads the first buffer of a batch of files with
+ two io_uring round trips: one for all the openat, one for all the reads.
+ * Return: 0/-1 if the ring fails (streams of the batch are then NULL).
+ */
+static int many_batch(struct uring *ring, const char * const *paths,
+		      size_t n, SO_FILE **streams)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int count = 0;
+	many_fn done = opened;
+	ssize_t len;
+	char *buf;
+	size_t i;
+	int drained;
+
+	for (i = 0; i < n; i++) {
+		streams[i] = alloc_stream(SO_BUFSIZE, 0);
+		if (streams[i] == NULL)
+			continue;
+		streams[i]->flags = O_RDONLY;
+		streams[i]->fd = -1;
+		streams[i]->pathname = strdup(paths[i]);
+		if (streams[i]->pathname == NULL) {
+			free_stream(streams[i]);
+			streams[i] = NULL;
+			continue;
+		}
+
+		sqe = uring_sqe(ring);
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t) paths[i];
+		sqe->open_flags = O_RDONLY;
+		sqe->user_data = i;
+		count++;
+	}
+	if (many_wait(ring, &count, done, streams, paths) < 0)
+		goto fail;
+
+	count = 0;
+	done = primed;
+	for (i = 0; i < n; i++) {
+		/* Skip the failed ones and the ones opened by open_one: */
+		if (streams[i] == NULL || streams[i]->stats.refills != 0)
+			continue;
+		len = so_rbuffer_prepare(streams[i], &buf);
+		if (len < 0)
+			continue;
+
+		sqe = uring_sqe(ring);
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = streams[i]->fd;
+		sqe->addr = (uintptr_t) buf;
+		sqe->len = len;
+		sqe->off = (uint64_t) -1; /* file position */
+		sqe->user_data = i;
+		count++;
+	}
+	if (many_wait(ring, &count, done, streams, paths) < 0)
+		goto fail;
+
+	return 0;
+
+fail:
+	/*
+	 * Requests still in flight write into the streams (the reads into
+	 their buffers): wait for them once more. If the ring stays broken,
+	 the streams it still owns are leaked rather than freed under it.
+	 */
+	drained = (many_wait(ring, &count, done, streams, paths) == 0);
+	for (i = 0; i < n; i++) {
+		if (streams[i] == NULL)
+			continue;
+		if (streams[i]->registered) {
+			/* Opened by open_one: */
+			so_fclose(streams[i]);
+		} else {
+			if (streams[i]->fd >= 0)
+				close(streams[i]->fd);
+			if (drained)
+				free_stream(streams[i]);
+		}
+		streams[i] = NULL;
+	}
+	return -1;
+}
+
+/*
+ * Description: opens n files for reading and loads the first buffer of
+ each, in batches: io_uring submits the openat of a whole batch at once,
+ then all its reads, so a batch costs two system calls instead of two per
+ file. Without io_uring, or from the batch on which the ring fails, a few
+ threads open and read the files instead.
+ streams[i] is the stream of paths[i], NULL if it could not be opened.
+ * Return: number of streams opened.
+ */
+size_t so_fopen_many(const char * const *paths, size_t n, SO_FILE **streams)
+{
+	struct uring ring;
+	size_t i, k, opened = 0;
+
+	if (n > 1 && uring_init(&ring, MANY_BATCH) == 0) {
+		for (i = 0; i < n; i += k) {
+			k = n - i < MANY_BATCH ? n - i : MANY_BATCH;
+			if (many_batch(&ring, paths + i, k, streams + i) < 0)
+				break;
+		}
+		uring_exit(&ring);
+		if (i < n)
+			many_threads(paths + i, n - i, streams + i);
+	} else {
+		many_threads(paths, n, streams);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (streams[i] == NULL)
+			continue;
+		registry_add(streams[i]);
+		opened++;
+	}
+
+	return opened;
+}
@@ -0,0 +1,398 @@
+#define _GNU_SOURCE /* pipe2 */
+
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "utils.h"
+#include "pool.h"
+
+/*
+ * A pooled command is started once and serves messages in a loop. A
+ message is a sequence of frames (32 bit length in host byte order, then
+ the data) ended by an empty frame. For every request read from stdin,
+ the worker writes a response to stdout, where the empty frame is followed
+ by a 32 bit status. A "w" stream sends the written data as the request
+ and drops the response; a "r" stream sends an empty request and reads the
+ response. As the response of a "w" stream is only read at so_pclose, the
+ worker should read the whole request before writing more than a pipe
+ buffer of it.
+ */
+
+#define POOL_IDLE_MAX 16 /* idle workers kept, over all commands */
+#define POOL_FRAME_MAX (1U << 30) /* largest frame written */
+
+/*
+ * Structure for a worker: a command started once, with its stdin and
+ stdout connected to the library, that serves one message after another.
+ */
+struct pool_worker {
+	char *command;
+	int pid;
+	int to_fd; /* stdin of the worker */
+	int from_fd; /* stdout of the worker */
+	struct pool_worker *next; /* next idle worker */
+};
+
+/*
+ * Structure for the exchange of a pooled stream with its worker.
+ */
+struct pool_session {
+	struct pool_worker *worker;
+	uint32_t frame_left; /* bytes left in the response frame being read */
+	int done; /* 1 once the end frame and status were read */
+	int32_t status; /* reported by the worker */
+	int failed; /* 1 if the worker can not be reused */
+};
+
+static struct pool_worker *idle;
+static int nidle;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Description: closes the pipes of a worker, waits for it and frees it.
+ */
+static void worker_destroy(struct pool_worker *worker)
+{
+	close(worker->to_fd);
+	close(worker->from_fd);
+	waitpid(worker->pid, NULL, 0);
+	free(worker->command);
+	free(worker);
+}
+
+/*
+ * Description: starts a worker running command through /bin/sh.
+ * Return: worker/NULL if fails.
+ */
+static struct pool_worker *worker_spawn(const char *command)
+{
+	struct pool_worker *worker = calloc(1, sizeof(*worker));
+	int in[2], out[2];
+
+	if (worker == NULL)
+		return NULL;
+	worker->command = strdup(command);
+	if (worker->command == NULL)
+		goto fail_alloc;
+
+	if (pipe2(in, O_CLOEXEC) < 0)
+		goto fail_alloc;
+	if (pipe2(out, O_CLOEXEC) < 0)
+		goto fail_in;
+
+	worker->pid = fork();
+	switch (worker->pid) {
+	case -1:
+		goto fail_out;
+	case 0:
+		/* Child process; dup2 clears close-on-exec */
+		dup2(in[PIPE_READ], STDIN_FILENO);
+		dup2(out[PIPE_WRITE], STDOUT_FILENO);
+		execl("/bin/sh", "sh", "-c", command, (char *) 0);
+		_exit(127);
+	}
+
+	close(in[PIPE_READ]);
+	close(out[PIPE_WRITE]);
+	worker->to_fd = in[PIPE_WRITE];
+	worker->from_fd = out[PIPE_READ];
+
+	return worker;
+
+fail_out:
+	close(out[PIPE_READ]);
+	close(out[PIPE_WRITE]);
+fail_in:
+	close(in[PIPE_READ]);
+	close(in[PIPE_WRITE]);
+fail_alloc:
+	free(worker->command);
+	free(worker);
+	return NULL;
+}
+
+/*
+ * Description: takes an idle worker running command, dropping the ones
+ that exited meanwhile, or starts a new one.
+ * Return: worker/NULL if fails.
+ */
+static struct pool_worker *worker_get(const char *command)
+{
+	struct pool_worker **p, *worker, *dead = NULL, *next;
+
+	pthread_mutex_lock(&pool_lock);
+	for (p = &idle; (worker = *p) != NULL;) {
+		if (strcmp(worker->command, command) != 0) {
+			p = &worker->next;
+			continue;
+		}
+
+		*p = worker->next;
+		nidle--;
+		if (waitpid(worker->pid, NULL, WNOHANG) == 0)
+			break;
+
+		/* Already reaped, only its pipes are left: */
+		worker->pid = -1;
+		worker->next = dead;
+		dead = worker;
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	for (; dead != NULL; dead = next) {
+		next = dead->next;
+		close(dead->to_fd);
+		close(dead->from_fd);
+		free(dead->command);
+		free(dead);
+	}
+
+	return worker != NULL ? worker : worker_spawn(command);
+}
+
+/*
+ * Description: returns a worker to the pool, or destroys it if the pool
+ is full.
+ */
+static void worker_put(struct pool_worker *worker)
+{
+	pthread_mutex_lock(&pool_lock);
+	if (nidle < POOL_IDLE_MAX) {
+		worker->next = idle;
+		idle = worker;
+		nidle++;
+		worker = NULL;
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	if (worker != NULL)
+		worker_destroy(worker);
+}
+
+/*
+ * Description: writes all iovcnt buffers, retrying short and interrupted
+ writes.
+ * Return: 0/-1 if fails.
+ */
+static int writev_all(SO_FILE *stream, int fd, struct iovec *iov, int iovcnt)
+{
+	unsigned long long start = now_ns();
+	unsigned int calls = 0;
+	ssize_t rc;
+
+	while (iovcnt > 0) {
+		rc = writev(fd, iov, iovcnt);
+		calls++;
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			stats_syscalls(stream, calls, start);
+			return -1;
+		}
+
+		for (; iovcnt > 0 && (size_t) rc >= iov->iov_len; iov++, iovcnt--)
+			rc -= iov->iov_len;
+		if (iovcnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+
+	stats_syscalls(stream, calls, start);
+	return 0;
+}
+
+/*
+ * Description: reads exactly count bytes from the worker.
+ * Return: 0/-1 if fails or the worker closed its stdout.
+ */
+static int read_all(SO_FILE *stream, void *buf, size_t count)
+{
+	unsigned long long start = now_ns();
+	ssize_t rc = xread(stream->pool->worker->from_fd, buf, count);
+
+	stats_syscalls(stream, 1, start);
+	if (rc == (ssize_t) count)
+		return 0;
+	if (rc >= 0)
+		errno = EPIPE;
+	return -1;
+}
+
+/*
+ * Description: sends count bytes to the worker as frames of a message.
+ * Return: count/-1 if fails.
+ */
+ssize_t pool_write(SO_FILE *stream, const void *buf, size_t count)
+{
+	struct pool_session *session = stream->pool;
+	struct iovec iov[2];
+	size_t done = 0;
+	uint32_t len;
+
+	while (done < count) {
+		len = count - done < POOL_FRAME_MAX ? count - done :
+						      POOL_FRAME_MAX;
+		iov[0].iov_base = &len;
+		iov[0].iov_len = sizeof(len);
+		iov[1].iov_base = (char *) buf + done;
+		iov[1].iov_len = len;
+		if (writev_all(stream, session->worker->to_fd, iov, 2) < 0) {
+			session->failed = 1;
+			return -1;
+		}
+		done += len;
+	}
+
+	STATS_ADD(stream, bytes_written, count);
+	return count;
+}
+
+/*
+ * Description: reads up to count bytes of the response of the worker.
+ After the last frame of the response, the status is read and 0 returned.
+ * Return: number of bytes read/0 at the end of the response/-1 if fails.
+ */
+ssize_t pool_read(SO_FILE *stream, void *buf, size_t count)
+{
+	struct pool_session *session = stream->pool;
+	unsigned long long start;
+	ssize_t rc;
+
+	if (session->done)
+		return 0;
+
+	if (session->frame_left == 0) {
+		if (read_all(stream, &session->frame_left,
+			     sizeof(session->frame_left)) < 0)
+			goto fail;
+		if (session->frame_left == 0) {
+			if (read_all(stream, &session->status,
+				     sizeof(session->status)) < 0)
+				goto fail;
+			session->done = 1;
+			return 0;
+		}
+	}
+
+	if (count > session->frame_left)
+		count = session->frame_left;
+
+	start = now_ns();
+	do {
+		rc = read(session->worker->from_fd, buf, count);
+	} while (rc < 0 && errno == EINTR);
+	stats_syscalls(stream, 1, start);
+	if (rc <= 0) {
+		if (rc == 0)
+			errno = EPIPE;
+		goto fail;
+	}
+
+	session->frame_left -= rc;
+	STATS_ADD(stream, bytes_read, rc);
+	return rc;
+
+fail:
+	session->failed = 1;
+	return -1;
+}
+
+/*
+ * Description: ends the exchange of a pooled stream: finishes the request
+ (for "w" streams), skips the rest of the response and returns the worker
+ to the pool. A worker that broke the protocol is stopped instead. The
+ stream must have been flushed and is not freed.
+ * Return: status reported by the worker/-1 if fails.
+ */
+int pool_close(SO_FILE *stream)
+{
+	struct pool_session *session = stream->pool;
+	struct iovec iov;
+	uint32_t end = 0;
+	char skip[4096];
+	int rc;
+
+	if (stream->flags == O_WRONLY && !session->failed) {
+		iov.iov_base = &end;
+		iov.iov_len = sizeof(end);
+		if (writev_all(stream, session->worker->to_fd, &iov, 1) < 0)
+			session->failed = 1;
+	}
+
+	while (!session->failed && !session->done)
+		pool_read(stream, skip, sizeof(skip));
+
+	if (session->failed) {
+		worker_destroy(session->worker);
+		rc = -1;
+	} else {
+		worker_put(session->worker);
+		rc = session->status;
+	}
+	free(session);
+	stream->pool = NULL;
+
+	return rc;
+}
+
+/*
+ * Description: connects a stream allocated by so_popen_pool to a worker
+ running command; a "r" stream sends its (empty) request right away.
+ * Return: 0/-1 if fails.
+ */
+int pool_open(SO_FILE *stream, const char *command)
+{
+	struct pool_session *session = calloc(1, sizeof(*session));
+	struct iovec iov;
+	uint32_t end = 0;
+
+	if (session == NULL)
+		return -1;
+	session->worker = worker_get(command);
+	if (session->worker == NULL) {
+		free(session);
+		return -1;
+	}
+
+	stream->pool = session;
+	stream->pid = session->worker->pid;
+	if (stream->flags == O_WRONLY) {
+		stream->fd = session->worker->to_fd;
+		return 0;
+	}
+
+	stream->fd = session->worker->from_fd;
+	iov.iov_base = &end;
+	iov.iov_len = sizeof(end);
+	if (writev_all(stream, session->worker->to_fd, &iov, 1) < 0) {
+		worker_destroy(session->worker);
+		free(session);
+		stream->pool = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Description: stops the idle workers of the pool.
+ * Return: 0.
+ */
+int so_pool_clear(void)
+{
+	struct pool_worker *list, *next;
+
+	pthread_mutex_lock(&pool_lock);
+	list = idle;
+	idle = NULL;
+	nidle = 0;
+	pthread_mutex_unlock(&pool_lock);
+
+	for (; list != NULL; list = next) {
+		next = list->next;
+		worker_destroy(list);
+	}
+
+	return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "so_file.h"
+
+/*
+ * Pooled helper processes (so_popen_pool). stream_read and stream_write
+ go through pool_read and pool_write, which add and strip the framing;
+ so_pclose calls pool_close.
+ */
+
+ssize_t pool_read(SO_FILE *stream, void *buf, size_t count);
+ssize_t pool_write(SO_FILE *stream, const void *buf, size_t count);
+int pool_open(SO_FILE *stream, const char *command);
+int pool_close(SO_FILE *stream);
+
+#endif
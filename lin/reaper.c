@@ -0,0 +1,153 @@
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+#include "utils.h"
+#include "reaper.h"
+
+/*
+ * Structure for a child waited for in the background.
+ */
+struct reap {
+	int pid;
+	int pidfd; /* -1 if waited for by a thread of its own */
+	so_reap_cb done;
+	void *arg;
+};
+
+static int reaper_epfd = -1;
+static pthread_once_t reaper_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Description: waits for the child, then reports its status.
+ */
+static void reap(struct reap *r)
+{
+	int status, rc;
+
+	do {
+		rc = waitpid(r->pid, &status, 0);
+	} while (rc < 0 && errno == EINTR);
+
+	if (r->pidfd >= 0)
+		close(r->pidfd);
+	if (r->done != NULL)
+		r->done(r->pid, rc < 0 ? -1 : status, r->arg);
+	free(r);
+}
+
+/*
+ * Description: reaper thread: a pidfd becomes readable once its process
+ exits, so the waitpid done then does not block.
+ */
+static void *reaper_thread(void *arg)
+{
+	struct epoll_event events[16];
+	int epfd = (int) (intptr_t) arg;
+	int i, n;
+
+	for (;;) {
+		n = epoll_wait(epfd, events, 16, -1);
+		for (i = 0; i < n; i++) {
+			struct reap *r = events[i].data.ptr;
+
+			epoll_ctl(epfd, EPOLL_CTL_DEL, r->pidfd, NULL);
+			reap(r);
+		}
+	}
+
+	return NULL;
+}
+
+static void *reap_thread(void *arg)
+{
+	reap(arg);
+	return NULL;
+}
+
+/*
+ * Description: starts the reaper thread, once per process. The thread
+ gets the epoll descriptor as its argument, so it never waits on
+ reaper_epfd before it is set.
+ */
+static void reaper_start(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int epfd;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		return;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, reaper_thread,
+			   (void *) (intptr_t) epfd) == 0)
+		reaper_epfd = epfd;
+	else
+		close(epfd);
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * Description: fork handler of the child, called by that of the registry.
+ The child has no reaper thread and must not add its children to the
+ epoll instance it shares with the parent (whose thread would then free
+ memory of the child), so it gets one of its own when it needs it. The
+ children still watched belong to the parent.
+ */
+void reaper_fork_child(void)
+{
+	static const pthread_once_t once_init = PTHREAD_ONCE_INIT;
+
+	if (reaper_epfd >= 0)
+		close(reaper_epfd);
+	reaper_epfd = -1;
+	reaper_once = once_init;
+}
+
+/*
+ * Description: waits for the child in the background and calls done
+ with its wait status (-1 if it can not be waited for). Children are
+ watched through pidfds by a single reaper thread; without pidfd support
+ each child gets a thread of its own, and if even that fails, it is
+ waited for right away.
+ */
+void reaper_add(int pid, so_reap_cb done, void *arg)
+{
+	struct reap *r = malloc(sizeof(*r));
+	struct epoll_event ev = { .events = EPOLLIN };
+	pthread_attr_t attr;
+	pthread_t thread;
+	int rc;
+
+	if (r == NULL) {
+		waitpid(pid, NULL, 0);
+		if (done != NULL)
+			done(pid, -1, arg);
+		return;
+	}
+	r->pid = pid;
+	r->done = done;
+	r->arg = arg;
+
+	pthread_once(&reaper_once, reaper_start);
+	r->pidfd = syscall(SYS_pidfd_open, pid, 0);
+	if (r->pidfd >= 0 && reaper_epfd >= 0) {
+		ev.data.ptr = r;
+		if (epoll_ctl(reaper_epfd, EPOLL_CTL_ADD, r->pidfd, &ev) == 0)
+			return;
+	}
+	if (r->pidfd >= 0) {
+		close(r->pidfd);
+		r->pidfd = -1;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rc = pthread_create(&thread, &attr, reap_thread, r);
+	pthread_attr_destroy(&attr);
+	if (rc != 0)
+		reap(r);
+}
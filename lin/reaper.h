@@ -0,0 +1,13 @@
+#ifndef REAPER_H
+#define REAPER_H
+
+#include "so_file.h"
+
+/*
+ * Background reaping of popen children (so_pclose_async).
+ */
+
+void reaper_add(int pid, so_reap_cb done, void *arg);
+void reaper_fork_child(void);
+
+#endif
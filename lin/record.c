@@ -0,0 +1,391 @@
+#include "utils.h"
+#include "record.h"
+#include "autoflush.h"
+#include "budget.h"
+
+#define VARINT_MAX 10 /* bytes of the LEB128 encoding of a 64 bit length */
+
+/*
+ * Structure for the record reader state of a stream.
+ */
+struct record {
+	char *scratch; /* records that cross a refill are built here */
+	size_t capacity;
+	int bad; /* errno of a malformed record, until the next seek */
+};
+
+/*
+ * Description: encodes len as LEB128: 7 bits per byte, low bits first,
+ the top bit set on every byte but the last.
+ * Return: number of bytes written to out.
+ */
+static int varint_encode(char *out, uint64_t len)
+{
+	int n = 0;
+
+	while (len >= 0x80) {
+		out[n++] = (char) (len | 0x80);
+		len >>= 7;
+	}
+	out[n++] = (char) len;
+
+	return n;
+}
+
+/*
+ * Description: decodes a LEB128 length from the bytes [p, end).
+ * Return: number of bytes used/0 if the length does not end before
+ end/-1 if it is longer than VARINT_MAX bytes.
+ */
+static int varint_decode(const char *p, const char *end, uint64_t *len)
+{
+	uint64_t v = 0;
+	int n;
+
+	for (n = 0; n < VARINT_MAX && p + n < end; n++) {
+		v |= (uint64_t) (p[n] & 0x7f) << (7 * n);
+		if ((p[n] & 0x80) == 0) {
+			*len = v;
+			return n + 1;
+		}
+	}
+
+	return n == VARINT_MAX ? -1 : 0;
+}
+
+/*
+ * Description: appends one record to wbuffer, flushing it first if the
+ record does not fit in the room left. Called with the stream lock held.
+ * Return: 1 if the record was appended/0 if it is larger than the
+ buffer/-1 if the flush fails.
+ */
+static int record_append(SO_FILE *stream, const void *data, size_t len)
+{
+	char hdr[VARINT_MAX];
+	int n = varint_encode(hdr, len);
+
+	if (stream->wbuffer == NULL && budget_wbuffer(stream) < 0)
+		return -1;
+	if (len > (size_t) stream->bufsize - n)
+		return 0;
+
+	if (n + len > (size_t) (stream->bufsize - stream->woffset) &&
+	    (unload_wbuffer(stream) <= 0 ||
+	     n + len > (size_t) (stream->bufsize - stream->woffset)))
+		return -1;
+
+	memcpy(stream->wbuffer + stream->woffset, hdr, n);
+	memcpy(stream->wbuffer + stream->woffset + n, data, len);
+	stream->woffset += n + len;
+
+	return 1;
+}
+
+/*
+ * Description: writes a record too large for the write buffer: its
+ length goes through the buffer and its bytes straight to the file.
+ * Return: 0/SO_EOF if fails.
+ */
+static int record_write_large(SO_FILE *stream, const void *data, size_t len)
+{
+	char hdr[VARINT_MAX];
+	int n = varint_encode(hdr, len);
+
+	if (so_fwrite(hdr, 1, n, stream) != (size_t) n ||
+	    so_fwrite(data, 1, len, stream) != len)
+		return SO_EOF;
+
+	return 0;
+}
+
+/*
+ * Description: writes a length-prefixed record (LEB128 length, then len
+ bytes of data). The record is built directly in the write buffer.
+ * Return: 0/SO_EOF if fails.
+ */
+int so_fwrite_record(SO_FILE *stream, const void *data, size_t len)
+{
+	int rc;
+
+	if (stream->direct) {
+		errno = EINVAL;
+		return SO_EOF;
+	}
+
+	autoflush_lock(stream);
+	rc = record_append(stream, data, len);
+	autoflush_unlock(stream);
+
+	if (rc == 0)
+		return record_write_large(stream, data, len);
+
+	return rc < 0 ? SO_EOF : 0;
+}
+
+/*
+ * Description: writes n records, see so_fwrite_record. The stream lock
+ is taken once for the whole batch.
+ * Return: number of records written.
+ */
+size_t so_fwrite_records(SO_FILE *stream, const struct so_record *recs,
+			 size_t n)
+{
+	size_t i = 0;
+	int rc;
+
+	if (stream->direct) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	while (i < n) {
+		autoflush_lock(stream);
+		for (rc = 1; i < n; i++) {
+			rc = record_append(stream, recs[i].data, recs[i].len);
+			if (rc <= 0)
+				break;
+		}
+		autoflush_unlock(stream);
+
+		if (rc < 0 ||
+		    (rc == 0 &&
+		     record_write_large(stream, recs[i].data, recs[i].len)))
+			break;
+		if (rc == 0)
+			i++;
+	}
+
+	return i;
+}
+
+/*
+ * Description: makes room for len bytes in the scratch buffer.
+ * Return: 0/-1 if memory allocation fails.
+ */
+static int scratch_reserve(struct record *rec, size_t len)
+{
+	size_t capacity = rec->capacity ? rec->capacity : 256;
+	char *p;
+
+	if (len <= rec->capacity)
+		return 0;
+	while (capacity < len)
+		capacity = capacity > SIZE_MAX / 2 ? len : capacity * 2;
+
+	p = realloc(rec->scratch, capacity);
+	if (p == NULL)
+		return -1;
+	rec->scratch = p;
+	rec->capacity = capacity;
+
+	return 0;
+}
+
+/*
+ * Description: stops the reader at a malformed record: its length may
+ have been consumed already, so reading on would parse from the middle
+ of it. Reads fail with err until the stream is repositioned.
+ * Return: SO_EOF.
+ */
+static int record_bad(SO_FILE *stream, int err)
+{
+	stream->rerror = SO_EOF;
+	stream->record->bad = err;
+	errno = err;
+
+	return SO_EOF;
+}
+
+/*
+ * Description: bytes of a regular file left after the read buffer, to
+ bound the length of a record.
+ * Return: bytes/-1 if unknown (pipes, followed or concatenated streams).
+ */
+static off_t file_left(SO_FILE *stream)
+{
+	struct stat st;
+	off_t off;
+
+	if (stream->follow != NULL || stream->concat != NULL ||
+	    fstat(stream->fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return -1;
+
+	off = stream_lseek(stream, 0, SEEK_CUR);
+	if (off < 0 || off > st.st_size)
+		return -1;
+
+	return st.st_size - off;
+}
+
+/*
+ * Description: reads a record that is not whole in the read buffer: its
+ length byte by byte, then its bytes, in place if they are buffered or
+ else into the scratch buffer. A length longer than the rest of the
+ file is malformed, so that a corrupt one does not size the scratch buffer.
+ * Return: 1/0 at EOF before the record/SO_EOF if fails or the record is
+ malformed or cut short by EOF (errno EBADMSG).
+ */
+static int record_read_slow(SO_FILE *stream, struct so_record *out)
+{
+	struct record *rec = stream->record;
+	uint64_t len = 0;
+	size_t have;
+	off_t left;
+	int c, n, rc;
+
+	for (n = 0; ; n++) {
+		if (n == VARINT_MAX)
+			goto malformed;
+		if (stream->roffset == stream->rsize) {
+			rc = load_rbuffer(stream);
+			if (rc < 0)
+				return SO_EOF;
+			if (rc == 0 && n == 0)
+				return 0;
+			if (rc == 0)
+				goto malformed;
+		}
+		c = (unsigned char) stream->rbuffer[stream->roffset++];
+		len |= (uint64_t) (c & 0x7f) << (7 * n);
+		if ((c & 0x80) == 0)
+			break;
+	}
+	if (len > SIZE_MAX / 2)
+		return record_bad(stream, EOVERFLOW);
+
+	have = stream->rsize - stream->roffset;
+	if (have >= len) {
+		out->data = stream->rbuffer + stream->roffset;
+		out->len = len;
+		stream->roffset += len;
+		return 1;
+	}
+
+	left = file_left(stream);
+	if (left >= 0 && len - have > (uint64_t) left)
+		goto malformed;
+	if (scratch_reserve(rec, len) < 0)
+		return SO_EOF;
+	if (so_fread(rec->scratch, 1, len, stream) != len)
+		goto malformed;
+	out->data = rec->scratch;
+	out->len = len;
+
+	return 1;
+
+malformed:
+	return record_bad(stream, EBADMSG);
+}
+
+/*
+ * Description: takes the next record from the read buffer if it is whole
+ there, without copying it.
+ * Return: 1 if taken/0 if not whole in the buffer/-1 if its length is
+ malformed (longer than VARINT_MAX bytes).
+ */
+static int record_take(SO_FILE *stream, struct so_record *out)
+{
+	const char *p = stream->rbuffer + stream->roffset;
+	const char *end = stream->rbuffer + stream->rsize;
+	uint64_t len;
+	int n;
+
+	if (p == end)
+		return 0;
+	n = varint_decode(p, end, &len);
+	if (n <= 0)
+		return n;
+	if (len > (uint64_t) (end - p - n))
+		return 0;
+
+	out->data = p + n;
+	out->len = len;
+	stream->roffset += n + len;
+
+	return 1;
+}
+
+/*
+ * Description: reads a length-prefixed record written by
+ so_fwrite_record. The record is returned as a span into the read buffer,
+ or into a scratch buffer of the stream when it crosses a refill; either
+ way it is valid until the next operation on the stream. Non-blocking
+ streams are not supported. After a malformed record (so_ferror is set),
+ reads fail until so_fseek.
+ * Return: 1 if a record was read/0 at EOF/SO_EOF if fails.
+ */
+int so_fread_record(SO_FILE *stream, struct so_record *rec)
+{
+	int rc;
+
+	if (stream->nonblock) {
+		errno = EINVAL;
+		return SO_EOF;
+	}
+	if (stream->record == NULL) {
+		stream->record = calloc(1, sizeof(*stream->record));
+		if (stream->record == NULL)
+			return SO_EOF;
+	}
+	if (stream->record->bad != 0) {
+		errno = stream->record->bad;
+		return SO_EOF;
+	}
+
+	rc = record_take(stream, rec);
+	if (rc < 0)
+		return record_bad(stream, EBADMSG);
+	if (rc > 0)
+		return 1;
+
+	return record_read_slow(stream, rec);
+}
+
+/*
+ * Description: reads up to n records. Every record whole in the read
+ buffer is returned without copying; the batch stops before the first
+ one that is not, unless it is the first of the batch. The records are
+ valid until the next operation on the stream.
+ * Return: number of records read/0 at EOF or if fails (see so_feof).
+ */
+size_t so_fread_records(SO_FILE *stream, struct so_record *recs, size_t n)
+{
+	size_t i;
+	int rc;
+
+	if (n == 0)
+		return 0;
+	if (so_fread_record(stream, &recs[0]) <= 0)
+		return 0;
+
+	for (i = 1; i < n; i++) {
+		rc = record_take(stream, &recs[i]);
+		if (rc <= 0)
+			break;
+	}
+
+	return i;
+}
+
+/*
+ * Description: called once the stream is repositioned: reading may go
+ on from a record boundary again.
+ */
+void record_reset(SO_FILE *stream)
+{
+	if (stream->record != NULL)
+		stream->record->bad = 0;
+}
+
+/*
+ * Description: frees the record reader state of a stream.
+ */
+void record_free(SO_FILE *stream)
+{
+	if (stream->record == NULL)
+		return;
+
+	free(stream->record->scratch);
+	free(stream->record);
+	stream->record = NULL;
+}
@@ -0,0 +1,16 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include "so_file.h"
+
+/*
+ * Length-prefixed records (so_fwrite_record/so_fread_record): a LEB128
+ length, then the bytes. Records are built in wbuffer and returned as
+ spans into rbuffer; only a record that crosses a refill is copied, into
+ the scratch buffer of the stream.
+ */
+
+void record_reset(SO_FILE *stream);
+void record_free(SO_FILE *stream);
+
+#endif
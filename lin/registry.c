@@ -0,0 +1,183 @@
+#include <pthread.h>
+#include <stdio.h>
+
+#include "utils.h"
+#include "registry.h"
+#include "autoflush.h"
+#include "reaper.h"
+#include "durability.h"
+
+#define REGISTRY_SHARDS 16 /* power of 2 */
+
+/*
+ * Structure for a shard: a list of streams, linked through their
+ reg_prev/reg_next fields.
+ */
+struct registry_shard {
+	pthread_mutex_t lock;
+	SO_FILE *head;
+} __attribute__((aligned(64)));
+
+static struct registry_shard shards[REGISTRY_SHARDS];
+static pthread_once_t registry_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Description: picks the shard of a stream from its address. Streams are
+ at least 64 bytes apart, so the low bits are dropped.
+ */
+static struct registry_shard *shard_of(SO_FILE *stream)
+{
+	uintptr_t h = (uintptr_t) stream >> 6;
+
+	return &shards[(h ^ h >> 4) & (REGISTRY_SHARDS - 1)];
+}
+
+/*
+ * Description: flushes every stream, one shard at a time. The shard lock
+ is held meanwhile, so a stream being closed waits in registry_remove
+ until it is flushed. At exit, non-blocking streams are switched back to
+ blocking first, as in so_fclose.
+ * Return: 0/SO_EOF if any flush fails.
+ */
+static int flush_all(int at_exit)
+{
+	struct registry_shard *shard;
+	SO_FILE *stream;
+	int rc = 0;
+
+	for (shard = shards; shard < shards + REGISTRY_SHARDS; shard++) {
+		pthread_mutex_lock(&shard->lock);
+		for (stream = shard->head; stream != NULL;
+		     stream = stream->reg_next) {
+			if (at_exit && stream->nonblock)
+				so_fsetnonblock(stream, 0);
+			if (so_fflush(stream) != 0)
+				rc = SO_EOF;
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+
+	return rc;
+}
+
+static void registry_exit(void)
+{
+	flush_all(1);
+}
+
+/*
+ * Description: fork handlers. The shard locks (then the timer lock of
+ autoflush and the commit group locks) are held across fork so that the
+ child gets consistent lists. The child drops the output buffered by
+ every stream: it belongs to the parent, which still writes it, and would
+ otherwise be written twice (for instance by the atexit flush of a child
+ that does not exec). The background reaper is reset in the child as well.
+ */
+static void registry_prepare(void)
+{
+	int i;
+
+	for (i = 0; i < REGISTRY_SHARDS; i++)
+		pthread_mutex_lock(&shards[i].lock);
+	autoflush_fork_prepare();
+	durability_fork_prepare();
+}
+
+static void registry_parent(void)
+{
+	int i;
+
+	durability_fork_parent();
+	autoflush_fork_parent();
+	for (i = REGISTRY_SHARDS - 1; i >= 0; i--)
+		pthread_mutex_unlock(&shards[i].lock);
+}
+
+static void registry_child(void)
+{
+	SO_FILE *stream;
+	int i;
+
+	autoflush_fork_child();
+	durability_fork_child();
+	reaper_fork_child();
+	for (i = 0; i < REGISTRY_SHARDS; i++) {
+		for (stream = shards[i].head; stream != NULL;
+		     stream = stream->reg_next) {
+			autoflush_forked(stream);
+			stream->woffset = 0;
+		}
+		pthread_mutex_init(&shards[i].lock, NULL);
+	}
+}
+
+static void registry_init(void)
+{
+	int i;
+
+	for (i = 0; i < REGISTRY_SHARDS; i++)
+		pthread_mutex_init(&shards[i].lock, NULL);
+	atexit(registry_exit);
+	pthread_atfork(registry_prepare, registry_parent, registry_child);
+}
+
+/*
+ * Description: adds a stream to the registry, once it is fully opened
+ (it is visible to so_fflushall from then on). Adding it again does
+ nothing.
+ */
+void registry_add(SO_FILE *stream)
+{
+	struct registry_shard *shard = shard_of(stream);
+
+	if (stream->registered)
+		return;
+	pthread_once(&registry_once, registry_init);
+
+	pthread_mutex_lock(&shard->lock);
+	stream->reg_prev = NULL;
+	stream->reg_next = shard->head;
+	if (shard->head != NULL)
+		shard->head->reg_prev = stream;
+	shard->head = stream;
+	stream->registered = 1;
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Description: removes a stream from the registry, if it is still there.
+ Closing functions call it before they touch the stream, so that it is not
+ flushed by so_fflushall at the same time.
+ */
+void registry_remove(SO_FILE *stream)
+{
+	struct registry_shard *shard = shard_of(stream);
+
+	if (!stream->registered)
+		return;
+
+	pthread_mutex_lock(&shard->lock);
+	if (stream->reg_prev != NULL)
+		stream->reg_prev->reg_next = stream->reg_next;
+	else
+		shard->head = stream->reg_next;
+	if (stream->reg_next != NULL)
+		stream->reg_next->reg_prev = stream->reg_prev;
+	stream->registered = 0;
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Description: flushes the write buffers of all open streams (and syncs
+ the durable ones), like fflush(NULL). It also runs at exit, so data
+ buffered by streams that are never closed is not lost. Other threads may
+ open and close streams meanwhile, but must not write to a stream being
+ flushed unless it has autoflush set (which locks it).
+ * Return: 0/SO_EOF if any stream fails to flush.
+ */
+int so_fflushall(void)
+{
+	pthread_once(&registry_once, registry_init);
+
+	return flush_all(0);
+}
@@ -0,0 +1,15 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include "so_file.h"
+
+/*
+ * Registry of the open streams (so_fflushall), kept in shards so that
+ opening and closing from several threads rarely contend. Streams are
+ flushed at exit; a forked child drops the buffered output it inherits.
+ */
+
+void registry_add(SO_FILE *stream);
+void registry_remove(SO_FILE *stream);
+
+#endif
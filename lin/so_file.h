@@ -0,0 +1,100 @@
+#ifndef SO_FILE_H
+#define SO_FILE_H
+
+/*
+ * Internal layout of SO_FILE, shared by the modules of the library.
+ */
+
+#include "so_stdio.h"
+
+struct durability;
+struct line_index;
+struct follow;
+struct csv;
+struct pool_session;
+struct concat;
+struct autoflush;
+struct record;
+struct filter;
+
+/*
+ * Strcture for a FILE stream. The first fields must match struct
+ _so_file_buf from so_stdio.h, which the inline so_getc/so_putc use.
+ */
+typedef struct _so_file {
+	char *rbuffer; /* read buffer */
+	int roffset; /* offset in read buffer */
+	int rsize; /* number of bytes read in rbuffer */
+
+	char *wbuffer; /* write buffer */
+	int woffset; /* offset in write buffer */
+	int wlimit; /* so_putc may fill wbuffer up to this offset */
+
+	int fd; /* file descriptor */
+	int flags; /* openning flags */
+
+	int pid; /* the process ID, in case of opening through popen */
+
+	int rerror; /* 0 if last read succeeded / SO_EOF if not */
+	int werror; /* 0 if last write succeeded / SO_EOF if not */
+
+	int bufsize; /* capacity of each buffer */
+	int fixed; /* 1 if bufsize may not adapt (so_setvbuf, direct) */
+	int rstreak; /* full (> 0) or short (< 0) refills in a row */
+	int wstreak; /* same for flushes */
+	int direct; /* 1 if opened through so_fopen_direct */
+	int rskip; /* bytes to skip in the next loaded block (direct mode) */
+	int nonblock; /* 1 if I/O may stop with EAGAIN (so_fsetnonblock) */
+
+	struct so_stats stats; /* I/O counters for this stream */
+
+	struct durability *durability; /* NULL unless durable writes were set */
+
+	char *pathname; /* NULL for streams opened through popen */
+	struct line_index *lindex; /* NULL unless so_findex was called */
+	struct follow *follow; /* NULL unless in follow mode (so_ffollow) */
+	struct csv *csv; /* NULL unless so_fnextfield was called */
+	struct record *record; /* NULL unless so_fread_record was called */
+	struct filter *filter; /* NULL unless so_fsetfilter is on */
+	struct pool_session *pool; /* NULL unless opened by so_popen_pool */
+	struct concat *concat; /* NULL unless opened by so_fopen_concat */
+	struct autoflush *autoflush; /* NULL unless so_fsetautoflush is on */
+
+	/* Links in the registry of open streams (registry.c): */
+	struct _so_file *reg_prev, *reg_next;
+	int registered; /* 0 once removed, while being closed */
+} SO_FILE;
+
+/* I/O counters aggregated over all streams of the process */
+extern struct so_stats global_stats;
+
+/* Adds n to a counter of both the stream and the process */
+#define STATS_ADD(stream, field, n)					\
+	do {								\
+		(stream)->stats.field += (n);				\
+		__atomic_fetch_add(&global_stats.field, (n),		\
+				   __ATOMIC_RELAXED);			\
+	} while (0)
+
+void stats_syscalls(SO_FILE *stream, unsigned int calls,
+		    unsigned long long start_ns);
+SO_FILE *alloc_stream(int bufsize, int align);
+void free_stream(SO_FILE *stream);
+ssize_t stream_read(SO_FILE *stream, void *buf, size_t count);
+ssize_t stream_write(SO_FILE *stream, const void *buf, size_t count);
+off_t stream_lseek(SO_FILE *stream, off_t offset, int whence);
+
+/* Checks if a failed syscall on a non-blocking stream would block */
+#define WOULD_BLOCK(stream, rc)						\
+	((stream)->nonblock && (rc) < 0 &&				\
+	 (errno == EAGAIN || errno == EWOULDBLOCK))
+
+int load_rbuffer(SO_FILE *stream);
+int unload_wbuffer(SO_FILE *stream);
+
+/* so_fseek, so_ftell and so_fflush, with the stream lock held: */
+int fseek_locked(SO_FILE *stream, long offset, int whence);
+long ftell_locked(SO_FILE *stream);
+int fflush_locked(SO_FILE *stream);
+
+#endif
@@ -1,24 +1,198 @@
+#define _GNU_SOURCE /* O_DIRECT */
+
 #include "utils.h"
 #include "so_stdio.h"
+#include "so_file.h"
+#include "durability.h"
+#include "lineindex.h"
+#include "follow.h"
+#include "csv.h"
+#include "record.h"
+#include "filter.h"
+#include "pool.h"
+#include "concat.h"
+#include "autoflush.h"
+#include "registry.h"
+#include "reaper.h"
+#include "budget.h"
+#include "bufmem.h"
+#include "trace.h"
+
+#define CHECK_PUBLIC_FIELD(field)					\
+	_Static_assert(offsetof(struct _so_file, field) ==		\
+		       offsetof(struct _so_file_buf, field),		\
+		       "SO_FILE does not start with struct _so_file_buf")
+
+CHECK_PUBLIC_FIELD(rbuffer);
+CHECK_PUBLIC_FIELD(roffset);
+CHECK_PUBLIC_FIELD(rsize);
+CHECK_PUBLIC_FIELD(wbuffer);
+CHECK_PUBLIC_FIELD(woffset);
+CHECK_PUBLIC_FIELD(wlimit);
+
+/* I/O counters aggregated over all streams of the process */
+struct so_stats global_stats;
+
+/*
+ * Description: accounts calls syscalls started at start_ns.
+ */
+void stats_syscalls(SO_FILE *stream, unsigned int calls,
+			   unsigned long long start_ns)
+{
+	STATS_ADD(stream, syscalls, calls);
+	STATS_ADD(stream, blocked_ns, now_ns() - start_ns);
+}
 
 /*
- * Strcture for a FILE stream.
+ * Description: read wrapper that updates stream statistics. Interrupted
+ reads are retried.
  */
-typedef struct _so_file {
-	int fd; /* file descriptor */
-	int flags; /* openning flags */
+ssize_t stream_read(SO_FILE *stream, void *buf, size_t count)
+{
+	unsigned long long start = now_ns();
+	unsigned int calls = 0;
+	ssize_t rc;
+
+	if (stream->pool != NULL)
+		return pool_read(stream, buf, count);
+	if (stream->concat != NULL)
+		return concat_read(stream, buf, count);
+
+	do {
+		rc = read(stream->fd, buf, count);
+		calls++;
+	} while (rc < 0 && errno == EINTR);
+
+	stats_syscalls(stream, calls, start);
+	if (rc > 0) {
+		STATS_ADD(stream, bytes_read, rc);
+		if ((size_t) rc < count)
+			STATS_ADD(stream, short_reads, 1);
+	}
+
+	return rc;
+}
+
+/*
+ * Description: xwrite wrapper that updates stream statistics. Every write
+ call after the first one means the previous write was short.
+ */
+ssize_t stream_write(SO_FILE *stream, const void *buf, size_t count)
+{
+	unsigned long long start;
+	unsigned int calls = 0;
+	ssize_t rc;
+
+	if (stream->pool != NULL)
+		return pool_write(stream, buf, count);
+
+	start = now_ns();
+	rc = xwrite(stream->fd, buf, count, &calls);
+
+	stats_syscalls(stream, calls, start);
+	if (calls > 1)
+		STATS_ADD(stream, short_writes, calls - 1);
+	if (rc > 0) {
+		STATS_ADD(stream, bytes_written, rc);
+		if (stream->durability != NULL)
+			durability_written(stream, rc);
+	}
+
+	return rc;
+}
+
+/*
+ * Description: lseek wrapper that updates stream statistics.
+ */
+off_t stream_lseek(SO_FILE *stream, off_t offset, int whence)
+{
+	unsigned long long start;
+	off_t rc;
+
+	if (stream->concat != NULL)
+		return concat_lseek(stream, offset, whence);
+
+	start = now_ns();
+	rc = lseek(stream->fd, offset, whence);
+
+	stats_syscalls(stream, 1, start);
+	return rc;
+}
+
+/*
+ * Description: allocates a stream. Its buffers are allocated on first use
+ (see budget.c), except if align is not 0: then both are allocated right
+ away, aligned to it (required by O_DIRECT), and keep their size.
+ * Return: stream/NULL if memory allocation fails.
+ */
+SO_FILE *alloc_stream(int bufsize, int align)
+{
+	SO_FILE *stream = (SO_FILE *) calloc(1, sizeof(SO_FILE));
+
+	if (stream == NULL)
+		return NULL;
 
-	int pid; /* the process ID, in case of opening through popen */
+	stream->bufsize = bufsize;
+	if (align == 0)
+		return stream;
 
-	char rbuffer[SO_BUFSIZE]; /* read buffer */
-	int roffset; /* offset in read buffer */
-	int rsize; /* number of bytes read in rbuffer */
-	int rerror; /* 0 if last read succeeded / SO_EOF if not */
+	stream->fixed = 1;
+	stream->rbuffer = bufmem_alloc(bufsize, align);
+	stream->wbuffer = bufmem_alloc(bufsize, align);
 
-	char wbuffer[SO_BUFSIZE]; /* write buffer */
-	int woffset; /* offset in write buffer */
-	int werror; /* 0 if last write succeeded / SO_EOF if not */
-} SO_FILE;
+	if (stream->rbuffer == NULL || stream->wbuffer == NULL) {
+		bufmem_free(stream->rbuffer, bufsize);
+		bufmem_free(stream->wbuffer, bufsize);
+		free(stream);
+		return NULL;
+	}
+	stream->wlimit = bufsize;
+	budget_account(stream);
+
+	return stream;
+}
+
+/*
+ * Description: frees a stream and its buffers.
+ */
+void free_stream(SO_FILE *stream)
+{
+	registry_remove(stream);
+	durability_free(stream);
+	lineindex_free(stream);
+	follow_free(stream);
+	csv_free(stream);
+	record_free(stream);
+	filter_free(stream);
+	concat_free(stream);
+	autoflush_free(stream);
+	free(stream->pathname);
+	budget_free(stream);
+	free(stream);
+}
+
+/*
+ * Description: translates a fopen-like mode into open flags.
+ * Return: flags/-1 for unknown mode.
+ */
+static int parse_mode(const char *mode)
+{
+	if (strcmp(mode, "r") == 0)
+		return O_RDONLY;
+	if (strcmp(mode, "r+") == 0)
+		return O_RDWR | O_CREAT;
+	if (strcmp(mode, "w") == 0)
+		return O_WRONLY | O_CREAT | O_TRUNC;
+	if (strcmp(mode, "w+") == 0)
+		return O_RDWR | O_CREAT | O_TRUNC;
+	if (strcmp(mode, "a") == 0)
+		return O_WRONLY | O_APPEND | O_CREAT;
+	if (strcmp(mode, "a+") == 0)
+		return O_RDWR | O_APPEND | O_CREAT;
+
+	/* Unknown mode */
+	return -1;
+}
 
 /**
  * Description: opens a file in a given mode.
@@ -26,54 +200,160 @@ typedef struct _so_file {
  */
 SO_FILE *so_fopen(const char *pathname, const char *mode)
 {
-	SO_FILE *stream = (SO_FILE *) calloc(1, sizeof(SO_FILE));
+	SO_FILE *stream;
+	int flags = parse_mode(mode);
+
+	if (flags < 0)
+		return NULL;
 
+	stream = alloc_stream(SO_BUFSIZE, 0);
 	if (stream == NULL)
 		return NULL;
 
-	if (strcmp(mode, "r") == 0) {
-		stream->fd = open(pathname, O_RDONLY);
-		stream->flags = O_RDONLY;
-	} else if (strcmp(mode, "r+") == 0) {
-		stream->fd = open(pathname, O_RDWR | O_CREAT);
-		stream->flags = O_RDWR | O_CREAT;
-	} else if (strcmp(mode, "w") == 0) {
-		stream->fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC);
-		stream->flags = O_WRONLY | O_CREAT | O_TRUNC;
-	} else if (strcmp(mode, "w+") == 0) {
-		stream->fd = open(pathname, O_RDWR | O_CREAT | O_TRUNC);
-		stream->flags = O_RDWR | O_CREAT | O_TRUNC;
-	} else if (strcmp(mode, "a") == 0) {
-		stream->fd = open(pathname, O_WRONLY | O_APPEND | O_CREAT);
-		stream->flags = O_WRONLY | O_APPEND | O_CREAT;
-	} else if (strcmp(mode, "a+") == 0) {
-		stream->fd = open(pathname, O_RDWR | O_APPEND | O_CREAT);
-		stream->flags = O_RDWR | O_APPEND | O_CREAT;
-	} else {
-		/* Unknown mode */
-		free(stream);
+	stream->pathname = strdup(pathname);
+	if (stream->pathname == NULL) {
+		free_stream(stream);
 		return NULL;
 	}
 
+	TRACE_START(start);
+	stream->flags = flags;
+	stream->fd = open(pathname, flags, 0644);
+	TRACE_END(start, TRACE_OPEN, stream->fd, 0);
 	if (stream->fd < 0) {
-		free(stream);
+		free_stream(stream);
 		return NULL;
 	}
+	registry_add(stream);
+
+	return stream;
+}
+
+/**
+ * Description: opens a file for cache-bypassing sequential I/O. Only "r"
+ and "w" modes are supported. Buffers have bufsize bytes (rounded up to
+ SO_DIRECT_ALIGN, SO_DIRECT_BUFSIZE if 0) and are aligned so that every
+ read/write issued is aligned, as O_DIRECT requires. If the filesystem
+ does not support O_DIRECT, the file is opened without it and the stream
+ behaves the same way.
+ * Return: stream/NULL if anything fails (memory allocation, file open).
+ */
+SO_FILE *so_fopen_direct(const char *pathname, const char *mode,
+			 size_t bufsize)
+{
+	SO_FILE *stream;
+	int flags;
+
+	if (strcmp(mode, "r") != 0 && strcmp(mode, "w") != 0)
+		return NULL;
+	flags = parse_mode(mode);
+
+	if (bufsize == 0)
+		bufsize = SO_DIRECT_BUFSIZE;
+	if (bufsize > INT_MAX - SO_DIRECT_ALIGN)
+		return NULL;
+	bufsize = (bufsize + SO_DIRECT_ALIGN - 1) & ~(SO_DIRECT_ALIGN - 1);
+
+	stream = alloc_stream(bufsize, SO_DIRECT_ALIGN);
+	if (stream == NULL)
+		return NULL;
+
+	stream->pathname = strdup(pathname);
+	if (stream->pathname == NULL) {
+		free_stream(stream);
+		return NULL;
+	}
+
+	TRACE_START(start);
+	stream->flags = flags;
+	stream->direct = 1;
+	stream->fd = open(pathname, flags | O_DIRECT, 0644);
+	if (stream->fd < 0 && errno == EINVAL)
+		stream->fd = open(pathname, flags, 0644);
+	TRACE_END(start, TRACE_OPEN, stream->fd, bufsize);
+	if (stream->fd < 0) {
+		free_stream(stream);
+		return NULL;
+	}
+	registry_add(stream);
 
 	return stream;
 }
 
 /*
- * Description: loads read buffer with data from file.
- * Return: number of bytes read/negative number if read fails.
+ * Description: changes the size of the stream buffers. Must be called
+ before any I/O is done on the stream. The size is then kept, instead of
+ adapting to the way the stream is used. Direct streams choose their
+ buffer size at so_fopen_direct.
+ * Return: 0/SO_EOF if fails.
  */
-int load_rbuffer(SO_FILE *stream)
+int so_setvbuf(SO_FILE *stream, size_t size)
 {
-	int bytes_read;
+	if (stream->direct || size == 0 || size > INT_MAX ||
+	    stream->rsize != 0 || stream->woffset != 0) {
+		errno = EINVAL;
+		return SO_EOF;
+	}
 
-	bytes_read = read(stream->fd, stream->rbuffer, SO_BUFSIZE);
-	if (bytes_read <= 0) {
+	budget_free(stream);
+	stream->bufsize = size;
+	stream->fixed = 1;
+
+	return 0;
+}
+
+/*
+ * Description: loads read buffer for a direct stream. The file offset is
+ always kept aligned: the first rskip bytes of the block are skipped and a
+ short read leaves the offset at the start of the last partial block (its
+ length becomes the next rskip), so reading may continue if file grows.
+ * Return: number of bytes made available/negative number if read fails.
+ */
+static int load_rbuffer_direct(SO_FILE *stream)
+{
+	int bytes_read, tail;
+
+	STATS_ADD(stream, refills, 1);
+	bytes_read = stream_read(stream, stream->rbuffer, stream->bufsize);
+	if (bytes_read < 0) {
+		stream->rerror = SO_EOF;
+		return bytes_read;
+	}
+
+	tail = bytes_read & (SO_DIRECT_ALIGN - 1);
+	if (tail != 0 && stream_lseek(stream, -tail, SEEK_CUR) < 0) {
+		stream->rerror = SO_EOF;
+		return -1;
+	}
+
+	if (bytes_read <= stream->rskip) {
+		/* Nothing past the requested position: */
+		stream->rsize = 0;
+		stream->roffset = 0;
 		stream->rerror = SO_EOF;
+		return 0;
+	}
+
+	stream->rsize = bytes_read;
+	stream->roffset = stream->rskip;
+	stream->rskip = tail;
+	stream->rerror = 0;
+
+	return bytes_read - stream->roffset;
+}
+
+/*
+ * Description: updates the read buffer once bytes_read bytes were read
+ into it (negative if the read failed).
+ * Return: bytes_read.
+ */
+static int rbuffer_loaded(SO_FILE *stream, int bytes_read)
+{
+	if (bytes_read <= 0) {
+		/* Not at EOF if no data is available yet: */
+		if (!WOULD_BLOCK(stream, bytes_read))
+			stream->rerror = SO_EOF;
+
 		return bytes_read;
 	}
 
@@ -85,21 +365,271 @@ int load_rbuffer(SO_FILE *stream)
 }
 
 /*
- * Description: unloads data from write buffer to file.
+ * Description: loads read buffer of a regular stream.
+ * Return: number of bytes read/negative number if read fails.
+ */
+static int load_rbuffer_plain(SO_FILE *stream)
+{
+	int bytes_read;
+
+	STATS_ADD(stream, refills, 1);
+	bytes_read = stream_read(stream, stream->rbuffer, stream->bufsize);
+	if (bytes_read == 0 && stream->follow != NULL)
+		bytes_read = follow_wait(stream, stream->rbuffer,
+					 stream->bufsize);
+
+	bytes_read = rbuffer_loaded(stream, bytes_read);
+	if (bytes_read > 0)
+		budget_adapt(stream, &stream->rstreak,
+			     bytes_read == stream->bufsize);
+
+	return bytes_read;
+}
+
+/*
+ * Description: unloads write buffer for a direct stream. A partial final
+ block is padded with zeros, the file is truncated back to its real size
+ and the block is kept at the start of the buffer, so following writes
+ complete it and it gets written again on the next unload.
  * Return: number of bytes wrote/0 or negative number if write fails.
  */
-int unload_wbuffer(SO_FILE *stream)
+static int unload_wbuffer_direct(SO_FILE *stream)
 {
-	int bytes_wrote;
+	int bytes_wrote, len, tail, rc;
+	unsigned long long start;
+	off_t pos = 0;
+
+	len = (stream->woffset + SO_DIRECT_ALIGN - 1) & ~(SO_DIRECT_ALIGN - 1);
+	tail = stream->woffset & (SO_DIRECT_ALIGN - 1);
+	if (tail != 0) {
+		memset(stream->wbuffer + stream->woffset, 0,
+		       len - stream->woffset);
+		pos = stream_lseek(stream, 0, SEEK_CUR);
+		if (pos < 0)
+			goto fail;
+	}
 
-	bytes_wrote = xwrite(stream->fd, stream->wbuffer, stream->woffset);
+	STATS_ADD(stream, flushes, 1);
+	bytes_wrote = stream_write(stream, stream->wbuffer, len);
+	if (bytes_wrote <= 0)
+		goto fail;
+
+	if (tail == 0) {
+		stream->woffset = 0;
+		return bytes_wrote;
+	}
+
+	/* Drop the padding and rewind to the partial block: */
+	start = now_ns();
+	rc = ftruncate(stream->fd, pos + stream->woffset);
+	stats_syscalls(stream, 1, start);
+	if (rc < 0 ||
+	    stream_lseek(stream, pos + stream->woffset - tail, SEEK_SET) < 0)
+		goto fail;
+
+	bytes_wrote = stream->woffset;
+	memmove(stream->wbuffer, stream->wbuffer + stream->woffset - tail, tail);
+	stream->woffset = tail;
+
+	return bytes_wrote;
+
+fail:
 	stream->woffset = 0;
+	stream->werror = SO_EOF;
+	return -1;
+}
+
+/*
+ * Description: updates the write buffer once bytes_wrote bytes from its
+ start were written (negative if the write failed). Bytes that were not
+ written yet, because a non-blocking or asynchronous write was short, are
+ moved to the start of wbuffer and errno is EAGAIN.
+ * Return: bytes_wrote.
+ */
+static int wbuffer_unloaded(SO_FILE *stream, int bytes_wrote)
+{
+	if (WOULD_BLOCK(stream, bytes_wrote))
+		return bytes_wrote;
 
 	if (bytes_wrote <= 0) {
+		stream->woffset = 0;
 		stream->werror = SO_EOF;
 		return bytes_wrote;
 	}
 
+	if (bytes_wrote < stream->woffset) {
+		memmove(stream->wbuffer, stream->wbuffer + bytes_wrote,
+			stream->woffset - bytes_wrote);
+		stream->woffset -= bytes_wrote;
+		errno = EAGAIN;
+		return bytes_wrote;
+	}
+
+	stream->woffset = 0;
+
+	return bytes_wrote;
+}
+
+/*
+ * Description: unloads write buffer of a regular stream.
+ * Return: number of bytes wrote/0 or negative number if write fails
+ (or would block before writing anything).
+ */
+static int unload_wbuffer_plain(SO_FILE *stream)
+{
+	int full = (stream->woffset == stream->bufsize);
+	int bytes_wrote;
+
+	STATS_ADD(stream, flushes, 1);
+	bytes_wrote = stream_write(stream, stream->wbuffer, stream->woffset);
+	bytes_wrote = wbuffer_unloaded(stream, bytes_wrote);
+	if (bytes_wrote > 0 && stream->woffset == 0)
+		budget_adapt(stream, &stream->wstreak, full);
+
+	return bytes_wrote;
+}
+
+/*
+ * Description: gives the area of an empty read buffer to be filled by a
+ read done outside the library (e.g. asynchronously), after which
+ so_rbuffer_commit must be called.
+ * Return: length of the area/-1 if the buffer still has data or the
+ stream is direct.
+ */
+ssize_t so_rbuffer_prepare(SO_FILE *stream, char **buf)
+{
+	if (stream->direct || stream->roffset != stream->rsize) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (budget_rbuffer(stream) < 0)
+		return -1;
+
+	*buf = stream->rbuffer;
+
+	return stream->bufsize;
+}
+
+/*
+ * Description: accounts the result of a read into the area given by
+ so_rbuffer_prepare: number of bytes, 0 at EOF or -errno.
+ * Return: res.
+ */
+ssize_t so_rbuffer_commit(SO_FILE *stream, ssize_t res)
+{
+	STATS_ADD(stream, refills, 1);
+	if (res > 0) {
+		STATS_ADD(stream, bytes_read, res);
+		if (res < stream->bufsize)
+			STATS_ADD(stream, short_reads, 1);
+	} else if (res < 0) {
+		errno = -res;
+	}
+
+	rbuffer_loaded(stream, res < 0 ? -1 : res);
+	if (stream->filter != NULL && res >= 0 &&
+	    filter_loaded(stream, res) < 0)
+		return -errno;
+
+	return stream->filter != NULL && res > 0 ? stream->rsize : res;
+}
+
+/*
+ * Description: gives the bytes waiting in the write buffer, to be written
+ outside the library, after which so_wbuffer_commit must be called.
+ * Return: number of bytes waiting/-1 if the stream is direct.
+ */
+ssize_t so_wbuffer_prepare(SO_FILE *stream, const char **buf)
+{
+	if (stream->direct) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (budget_wbuffer(stream) < 0)
+		return -1;
+
+	*buf = stream->wbuffer;
+
+	return stream->woffset;
+}
+
+/*
+ * Description: accounts the result of writing the bytes given by
+ so_wbuffer_prepare: number of bytes written or -errno. Bytes left after
+ a short write stay in the buffer. Once the buffer is empty, a durable
+ stream is synced (see so_fsetdurability), as by so_fflush.
+ * Return: number of bytes still waiting/-1 if the write or the sync
+ failed.
+ */
+ssize_t so_wbuffer_commit(SO_FILE *stream, ssize_t res)
+{
+	STATS_ADD(stream, flushes, 1);
+	if (res > 0) {
+		STATS_ADD(stream, bytes_written, res);
+		if (res < stream->woffset)
+			STATS_ADD(stream, short_writes, 1);
+		if (stream->durability != NULL)
+			durability_written(stream, res);
+	} else if (res < 0) {
+		errno = -res;
+	}
+
+	if (wbuffer_unloaded(stream, res < 0 ? -1 : res) <= 0 &&
+	    stream->werror)
+		return -1;
+
+	if (stream->woffset == 0 && stream->durability != NULL &&
+	    durability_sync(stream) < 0)
+		return -1;
+
+	return stream->woffset;
+}
+
+/*
+ * Description: loads read buffer with data from file.
+ * Return: number of bytes read/negative number if read fails.
+ */
+int load_rbuffer(SO_FILE *stream)
+{
+	int bytes_read;
+	TRACE_START(start);
+
+	if (budget_rbuffer(stream) < 0) {
+		stream->rerror = SO_EOF;
+		return -1;
+	}
+
+	if (stream->direct)
+		bytes_read = load_rbuffer_direct(stream);
+	else
+		bytes_read = load_rbuffer_plain(stream);
+
+	if (stream->filter != NULL) {
+		bytes_read = filter_loaded(stream, bytes_read);
+		/* All the data read was dropped by the filter: */
+		if (bytes_read < 0 && errno == EAGAIN && !stream->nonblock)
+			bytes_read = load_rbuffer(stream);
+	}
+
+	TRACE_END(start, TRACE_REFILL, stream->fd, bytes_read);
+	return bytes_read;
+}
+
+/*
+ * Description: unloads data from write buffer to file.
+ * Return: number of bytes wrote/0 or negative number if write fails.
+ */
+int unload_wbuffer(SO_FILE *stream)
+{
+	int bytes_wrote;
+	TRACE_START(start);
+
+	if (stream->direct)
+		bytes_wrote = unload_wbuffer_direct(stream);
+	else
+		bytes_wrote = unload_wbuffer_plain(stream);
+
+	TRACE_END(start, TRACE_FLUSH, stream->fd, bytes_wrote);
 	return bytes_wrote;
 }
 
@@ -111,16 +641,29 @@ int so_fclose(SO_FILE *stream)
 {
 	int rc;
 
+	registry_remove(stream);
+	autoflush_free(stream);
+
+	/* Pending data is written even if it has to wait for the fd: */
+	if (stream->nonblock)
+		so_fsetnonblock(stream, 0);
+
 	if (stream->woffset != 0) {
 		rc = unload_wbuffer(stream);
 		if (rc <= 0) {
-			free(stream);
+			free_stream(stream);
 			return rc;
 		}
 	}
 
+	if (stream->durability != NULL && durability_sync(stream) < 0) {
+		close(stream->fd);
+		free_stream(stream);
+		return SO_EOF;
+	}
+
 	rc = close(stream->fd);
-	free(stream);
+	free_stream(stream);
 
 	return (rc < 0) ? SO_EOF : 0;
 }
@@ -134,7 +677,7 @@ int so_fclose(SO_FILE *stream)
 int so_fgetc(SO_FILE *stream)
 {
 	int rc;
-	char c;
+	unsigned char c;
 
 	if (stream->roffset == stream->rsize) {
 		rc = load_rbuffer(stream);
@@ -149,15 +692,16 @@ int so_fgetc(SO_FILE *stream)
 }
 
 /*
- * Description: writes one character to stream. Tries first to put it into
- the buffer, but if write buffer is full, it must unload it first.
- * Return: the character wrote/SO_EOF.
+ * Description: so_fputc, with the stream lock held (see autoflush.c).
  */
-int so_fputc(int c, SO_FILE *stream)
+static int fputc_locked(int c, SO_FILE *stream)
 {
 	int rc;
 
-	if (stream->woffset == SO_BUFSIZE) {
+	if (stream->wbuffer == NULL && budget_wbuffer(stream) < 0)
+		return SO_EOF;
+
+	if (stream->woffset == stream->bufsize) {
 		rc = unload_wbuffer(stream);
 		if (rc <= 0)
 			return SO_EOF;
@@ -166,108 +710,243 @@ int so_fputc(int c, SO_FILE *stream)
 	stream->wbuffer[stream->woffset] = (char) c;
 	(stream->woffset)++;
 
-	return c;
+	return (unsigned char) c;
+}
+
+/*
+ * Description: writes one character to stream. Tries first to put it into
+ the buffer, but if write buffer is full, it must unload it first.
+ * Return: the character wrote/SO_EOF.
+ */
+int so_fputc(int c, SO_FILE *stream)
+{
+	int rc;
+
+	autoflush_lock(stream);
+	rc = fputc_locked(c, stream);
+	autoflush_unlock(stream);
+
+	return rc;
+}
+
+/*
+ * Description: checks if large transfers may skip the stream buffers.
+ Direct streams can not, as user memory is not aligned, followed streams
+ wait for data in load_rbuffer and filtered ones filter the read buffer.
+ */
+static int can_bypass(SO_FILE *stream)
+{
+	return !stream->direct && stream->follow == NULL &&
+	       stream->filter == NULL;
+}
+
+/*
+ * Description: computes the number of bytes for nmemb elements of given
+ size.
+ * Return: size * nmemb/0 if it overflows.
+ */
+static size_t total_bytes(size_t size, size_t nmemb)
+{
+	if (size != 0 && nmemb > SIZE_MAX / size) {
+		errno = EOVERFLOW;
+		return 0;
+	}
+
+	return size * nmemb;
 }
 
 /*
  * Description: reads nmemb elements of given size from a stream and puts
- read bytes to ptr.
- * Return: number of elements read/SO_EOF.
+ read bytes to ptr. Bytes are copied in spans as large as the buffer
+ allows; when the buffer is empty and at least a buffer worth of bytes is
+ left, they are read straight into ptr.
+ * Return: number of complete elements read.
  */
 size_t so_fread(void *ptr, size_t size, size_t nmemb, SO_FILE *stream)
 {
-	int i;
-	int offset = 0; /* offset in ptr */
-	int bytes_loaded;
-	size_t to_read; /* number of bytes to read */
-	size_t mem_read = 0; /* number of elements read succesfully */
-
-	for (i = 0; i < nmemb; i++) {
-		size_t bytes_read_now = 0; /* number of bytes read this time */
-
-		while (bytes_read_now < size) {
-			if (stream->roffset == stream->rsize) {
-				/* Read buffer must be reloaded first: */
-				bytes_loaded = load_rbuffer(stream);
-				if (bytes_loaded < 0)
-					return 0;
-				if (bytes_loaded == 0)
-					return mem_read;
+	size_t total = total_bytes(size, nmemb);
+	size_t done = 0; /* bytes copied to ptr */
+	size_t to_read;
+	ssize_t bytes_read;
+
+	if (total == 0)
+		return 0;
+
+	while (done < total) {
+		if (stream->roffset == stream->rsize) {
+			if (total - done >= (size_t) stream->bufsize &&
+			    can_bypass(stream)) {
+				bytes_read = stream_read(stream, ptr + done,
+							 total - done);
+				if (bytes_read <= 0) {
+					if (!WOULD_BLOCK(stream, bytes_read))
+						stream->rerror = SO_EOF;
+					break;
+				}
+				done += bytes_read;
+				continue;
 			}
 
-			/* Read either size bytes or all buffer: */
-			to_read = size;
-			if (stream->rsize - stream->roffset < to_read)
-				to_read = stream->rsize - stream->roffset;
-
-			/* Copy from buffer to ptr: */
-			memcpy(ptr + offset, stream->rbuffer + stream->roffset,
-				to_read);
-			stream->roffset += to_read;
-			bytes_read_now += to_read;
-			offset += to_read;
+			/* Read buffer must be reloaded first: */
+			if (load_rbuffer(stream) <= 0)
+				break;
 		}
 
-		if (bytes_read_now > 0)
-			mem_read++;
+		/* Copy either the rest or all buffer: */
+		to_read = stream->rsize - stream->roffset;
+		if (total - done < to_read)
+			to_read = total - done;
+
+		memcpy(ptr + done, stream->rbuffer + stream->roffset, to_read);
+		stream->roffset += to_read;
+		done += to_read;
 	}
 
-	return mem_read;
+	return done / size;
 }
 
 /*
- * Description: writes nmemb elements of given size from ptr to stream.
- * Return: number of elements succesfully wrote/SO_EOF.
+ * Description: so_fwrite, with the stream lock held (see autoflush.c).
  */
-size_t so_fwrite(const void *ptr, size_t size, size_t nmemb, SO_FILE *stream)
+static size_t fwrite_locked(const void *ptr, size_t size, size_t nmemb,
+			    SO_FILE *stream)
 {
-	int i;
-	int offset = 0; /* offset in ptr */
-	int bytes_unloaded;
-	size_t to_write; /* number of bytes to write */
-	size_t mem_wrote = 0; /* number of elements wrote succesfully */
-
-	for (i = 0; i < nmemb; i++) {
-		size_t bytes_wrote_now = 0;
-
-		while (bytes_wrote_now < size) {
-			if (stream->woffset == SO_BUFSIZE) {
-				/* Write buffer is full. Unload it first: */
-				bytes_unloaded = unload_wbuffer(stream);
-				if (bytes_unloaded <= 0)
-					return 0;
+	size_t total = total_bytes(size, nmemb);
+	size_t done = 0; /* bytes taken from ptr */
+	size_t unflushed = 0; /* bytes of ptr still in wbuffer */
+	size_t to_write;
+	ssize_t bytes_wrote;
+
+	if (total == 0)
+		return 0;
+
+	while (done < total) {
+		if (stream->woffset == 0 &&
+		    total - done >= (size_t) stream->bufsize &&
+		    can_bypass(stream)) {
+			bytes_wrote = stream_write(stream, ptr + done,
+						   total - done);
+			if (bytes_wrote <= 0) {
+				if (!WOULD_BLOCK(stream, bytes_wrote))
+					stream->werror = SO_EOF;
+				break;
 			}
+			done += bytes_wrote;
+			continue;
+		}
 
-			/* Write either size bytes or as much as write buffer
-			 * has space for:
-			 */
-			to_write = size;
-			if (SO_BUFSIZE - stream->woffset < to_write)
-				to_write = SO_BUFSIZE - stream->woffset;
-
-			/* Copy from ptr into write buffer: */
-			memcpy(stream->wbuffer + stream->woffset, ptr + offset,
-				to_write);
-			stream->woffset += to_write;
-			bytes_wrote_now += to_write;
-			offset += to_write;
+		if (stream->woffset == stream->bufsize) {
+			/* Write buffer is full. Unload it first: */
+			if (unload_wbuffer(stream) <= 0) {
+				/* Bytes are kept if the stream would block: */
+				if (WOULD_BLOCK(stream, -1))
+					return done / size;
+				return (done - unflushed) / size;
+			}
+			unflushed = 0;
+		}
+		if (stream->wbuffer == NULL && budget_wbuffer(stream) < 0) {
+			stream->werror = SO_EOF;
+			break;
 		}
 
-		if (bytes_wrote_now > 0)
-			mem_wrote++;
+		/* Copy either the rest or as much as write buffer has
+		 * space for:
+		 */
+		to_write = stream->bufsize - stream->woffset;
+		if (total - done < to_write)
+			to_write = total - done;
+
+		memcpy(stream->wbuffer + stream->woffset, ptr + done, to_write);
+		stream->woffset += to_write;
+		unflushed += to_write;
+		done += to_write;
 	}
 
-	return mem_wrote;
+	return done / size;
 }
 
 /*
- * Description: move file cursor position.
+ * Description: writes nmemb elements of given size from ptr to stream.
+ Like so_fread, bytes are moved in spans and a request of at least a
+ buffer worth of bytes is written straight from ptr if wbuffer is empty.
+ * Return: number of complete elements wrote.
+ */
+size_t so_fwrite(const void *ptr, size_t size, size_t nmemb, SO_FILE *stream)
+{
+	size_t rc;
+
+	autoflush_lock(stream);
+	rc = fwrite_locked(ptr, size, nmemb, stream);
+	autoflush_unlock(stream);
+
+	return rc;
+}
+
+/*
+ * Description: move file cursor position of a direct stream. The file
+ offset is aligned down and the rest is skipped when the block is loaded.
+ Write streams are only written sequentially, so they can not seek.
  * Return: 0 if succes/-1 fail.
  */
-int so_fseek(SO_FILE *stream, long offset, int whence)
+static int fseek_direct(SO_FILE *stream, long offset, int whence)
 {
-	int rc;
-	int off;
+	struct stat st;
+	long pos;
+
+	if (stream->flags != O_RDONLY) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	switch (whence) {
+	case SEEK_SET:
+		pos = offset;
+		break;
+	case SEEK_CUR:
+		pos = so_ftell(stream);
+		if (pos < 0)
+			return -1;
+		pos += offset;
+		break;
+	case SEEK_END:
+		if (fstat(stream->fd, &st) < 0)
+			return -1;
+		pos = st.st_size + offset;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (pos < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (stream->roffset != stream->rsize)
+		STATS_ADD(stream, seeks_discarded, 1);
+
+	if (stream_lseek(stream, pos & ~(long) (SO_DIRECT_ALIGN - 1),
+			 SEEK_SET) < 0)
+		return -1;
+
+	stream->rskip = pos & (SO_DIRECT_ALIGN - 1);
+	stream->roffset = 0;
+	stream->rsize = 0;
+	stream->rerror = 0;
+
+	return 0;
+}
+
+/*
+ * Description: move file cursor position of a regular stream.
+ * Return: 0 if succes/-1 fail.
+ */
+static int fseek_plain(SO_FILE *stream, long offset, int whence)
+{
+	int rc, discarded;
+	off_t off;
 
 	/* If anything is in write buffer, unload it: */
 	if (stream->woffset != 0) {
@@ -278,31 +957,77 @@ int so_fseek(SO_FILE *stream, long offset, int whence)
 	}
 
 	/* Disregard bytes read in advance in read buffer: */
+	discarded = (stream->roffset != stream->rsize);
+	if (discarded)
+		STATS_ADD(stream, seeks_discarded, 1);
 	if (whence == SEEK_CUR)
-		offset -= (stream->rsize - stream->roffset);
+		offset -= (stream->rsize - stream->roffset) +
+			  filter_ahead(stream);
 	stream->roffset = 0;
 	stream->rsize = 0;
 
-	off = lseek(stream->fd, offset, whence);
+	/* Read-ahead was wasted, larger buffers would waste more: */
+	if (discarded)
+		budget_adapt(stream, &stream->rstreak, 0);
+
+	off = stream_lseek(stream, offset, whence);
+	filter_reset(stream, off);
 	return (off == -1) ? -1 : 0;
 }
 
 /*
- * Description: get file cursor position.
- * Return: position/-1 if fail.
+ * Description: so_fseek, with the stream lock held (see autoflush.c).
  */
-long so_ftell(SO_FILE *stream)
+int fseek_locked(SO_FILE *stream, long offset, int whence)
+{
+	int rc;
+	TRACE_START(start);
+
+	if (stream->direct)
+		rc = fseek_direct(stream, offset, whence);
+	else
+		rc = fseek_plain(stream, offset, whence);
+	if (rc == 0)
+		record_reset(stream);
+
+	TRACE_END(start, TRACE_SEEK, stream->fd, offset);
+	return rc;
+}
+
+/*
+ * Description: move file cursor position.
+ * Return: 0 if succes/-1 fail.
+ */
+int so_fseek(SO_FILE *stream, long offset, int whence)
 {
-	int off;
+	int rc;
+
+	autoflush_lock(stream);
+	rc = fseek_locked(stream, offset, whence);
+	autoflush_unlock(stream);
+
+	return rc;
+}
+
+/*
+ * Description: so_ftell, with the stream lock held (see autoflush.c).
+ */
+long ftell_locked(SO_FILE *stream)
+{
+	off_t off;
 
 	/* Do a lseek from current position: */
-	off = lseek(stream->fd, 0, SEEK_CUR);
+	off = stream_lseek(stream, 0, SEEK_CUR);
 	if (off == -1)
 		return -1;
 
+	/* Direct streams are positioned inside the current block: */
+	off += stream->rskip;
+
 	/* If anything was read in advance, disregard it: */
 	if (stream->rsize != 0)
-		off = off - (stream->rsize - stream->roffset);
+		off = off - (stream->rsize - stream->roffset) -
+		      filter_ahead(stream);
 
 	/* If anything is in write buffer, add those bytes: */
 	if (stream->woffset != 0)
@@ -312,10 +1037,24 @@ long so_ftell(SO_FILE *stream)
 }
 
 /*
- * Description: flush the contents of write buffer.
- * Return: 0/SO_EOF.
+ * Description: get file cursor position.
+ * Return: position/-1 if fail.
  */
-int so_fflush(SO_FILE *stream)
+long so_ftell(SO_FILE *stream)
+{
+	long rc;
+
+	autoflush_lock(stream);
+	rc = ftell_locked(stream);
+	autoflush_unlock(stream);
+
+	return rc;
+}
+
+/*
+ * Description: so_fflush, with the stream lock held (see autoflush.c).
+ */
+int fflush_locked(SO_FILE *stream)
 {
 	int bytes_unloaded;
 
@@ -323,11 +1062,122 @@ int so_fflush(SO_FILE *stream)
 		bytes_unloaded = unload_wbuffer(stream);
 		if (bytes_unloaded <= 0)
 			return SO_EOF;
+
+		/*
+		 * A non-blocking stream may be left with data (EAGAIN); a
+		 * direct stream keeps its partial last block, already written:
+		 */
+		if (stream->woffset != 0 && !stream->direct)
+			return SO_EOF;
+	}
+
+	if (stream->durability != NULL && durability_sync(stream) < 0)
+		return SO_EOF;
+
+	return 0;
+}
+
+/*
+ * Description: flush the contents of write buffer and, if the stream was
+ set to be durable, sync the file.
+ * Return: 0/SO_EOF.
+ */
+int so_fflush(SO_FILE *stream)
+{
+	int rc;
+
+	autoflush_lock(stream);
+	rc = fflush_locked(stream);
+	autoflush_unlock(stream);
+
+	return rc;
+}
+
+/*
+ * Description: switches the stream in or out of non-blocking mode (sets
+ O_NONBLOCK on its fd). In non-blocking mode, operations that would block
+ fail with errno EAGAIN without setting the EOF/error flags, and data
+ that could not be written stays in the write buffer (see so_fpending).
+ Use elements of size 1 with so_fread/so_fwrite, so that the count they
+ return covers every byte moved.
+ * Return: 0/SO_EOF if fails.
+ */
+int so_fsetnonblock(SO_FILE *stream, int on)
+{
+	int flags;
+
+	if (stream->direct || stream->pool != NULL || stream->concat != NULL) {
+		errno = EINVAL;
+		return SO_EOF;
 	}
 
+	/* The autoflush timer toggles O_NONBLOCK too, under the lock: */
+	autoflush_lock(stream);
+	flags = fcntl(stream->fd, F_GETFL);
+	if (flags >= 0) {
+		flags = on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+		flags = fcntl(stream->fd, F_SETFL, flags);
+	}
+	if (flags >= 0)
+		stream->nonblock = (on != 0);
+	autoflush_unlock(stream);
+
+	return flags < 0 ? SO_EOF : 0;
+}
+
+/*
+ * Description: get the number of bytes waiting in the write buffer.
+ */
+size_t so_fpending(SO_FILE *stream)
+{
+	size_t pending;
+
+	autoflush_lock(stream);
+	pending = stream->woffset;
+	autoflush_unlock(stream);
+
+	return pending;
+}
+
+/*
+ * Description: copy the I/O counters of a stream.
+ * Return: 0.
+ */
+int so_fstats(SO_FILE *stream, struct so_stats *stats)
+{
+	autoflush_lock(stream);
+	*stats = stream->stats;
+	autoflush_unlock(stream);
+
 	return 0;
 }
 
+/*
+ * Description: copy the I/O counters aggregated over all streams opened
+ by the process (including already closed ones).
+ */
+void so_stats_global(struct so_stats *stats)
+{
+	stats->bytes_read = __atomic_load_n(&global_stats.bytes_read,
+					    __ATOMIC_RELAXED);
+	stats->bytes_written = __atomic_load_n(&global_stats.bytes_written,
+					       __ATOMIC_RELAXED);
+	stats->syscalls = __atomic_load_n(&global_stats.syscalls,
+					  __ATOMIC_RELAXED);
+	stats->refills = __atomic_load_n(&global_stats.refills,
+					 __ATOMIC_RELAXED);
+	stats->flushes = __atomic_load_n(&global_stats.flushes,
+					 __ATOMIC_RELAXED);
+	stats->seeks_discarded = __atomic_load_n(&global_stats.seeks_discarded,
+						 __ATOMIC_RELAXED);
+	stats->short_reads = __atomic_load_n(&global_stats.short_reads,
+					     __ATOMIC_RELAXED);
+	stats->short_writes = __atomic_load_n(&global_stats.short_writes,
+					      __ATOMIC_RELAXED);
+	stats->blocked_ns = __atomic_load_n(&global_stats.blocked_ns,
+					    __ATOMIC_RELAXED);
+}
+
 /*
  * Description: get file descriptor.
  */
@@ -364,7 +1214,7 @@ SO_FILE *so_popen(const char *command, const char *type)
 	int rc;
 	SO_FILE *stream;
 
-	stream = (SO_FILE *) calloc(1, sizeof(SO_FILE));
+	stream = alloc_stream(SO_BUFSIZE, 0);
 	if (stream == NULL)
 		return NULL;
 
@@ -374,16 +1224,19 @@ SO_FILE *so_popen(const char *command, const char *type)
 		stream->flags = O_WRONLY;
 	} else {
 		/* Unknown type */
-		free(stream);
+		free_stream(stream);
 		return NULL;
 	}
 
-	/* Create pipe: */
+	/*
+	 * Create pipe, close-on-exec so that other children (pool workers,
+	 * later popen commands) do not keep it open; dup2 clears the flag:
+	 */
 	int fds[2];
 
-	rc = pipe(fds);
+	rc = pipe2(fds, O_CLOEXEC);
 	if (rc != 0) {
-		free(stream);
+		free_stream(stream);
 		return NULL;
 	}
 
@@ -393,6 +1246,7 @@ SO_FILE *so_popen(const char *command, const char *type)
 		stream->fd = fds[PIPE_WRITE];
 
 	/* Create process: */
+	TRACE_START(start);
 	int pid = fork();
 
 	switch (pid) {
@@ -400,7 +1254,7 @@ SO_FILE *so_popen(const char *command, const char *type)
 		/* Fork failed. */
 		close(fds[PIPE_READ]);
 		close(fds[PIPE_WRITE]);
-		free(stream);
+		free_stream(stream);
 
 		return NULL;
 	case 0:
@@ -413,14 +1267,12 @@ SO_FILE *so_popen(const char *command, const char *type)
 			dup2(fds[PIPE_READ], STDIN_FILENO);
 		}
 
-		/* Launch command */
-		rc = execl("/bin/sh", "sh", "-c", command, (char *)0);
-		if (rc)
-			return NULL;
-
-		break;
+		/* Launch command; a failed child must not return to the caller: */
+		execl("/bin/sh", "sh", "-c", command, (char *)0);
+		_exit(127);
 	default:
 		/* Parent process */
+		TRACE_END(start, TRACE_POPEN, stream->fd, pid);
 		stream->pid = pid;
 
 		if (stream->flags == O_RDONLY)
@@ -430,36 +1282,143 @@ SO_FILE *so_popen(const char *command, const char *type)
 
 		break;
 	}
+	registry_add(stream);
 
 	return stream;
 }
 
+/*
+ * Description: like so_popen, but the command keeps running: so_pclose
+ returns it to a pool (and returns the status it reported) and the next
+ so_popen_pool of the same command reuses it, without fork and exec. See
+ pool.c for the protocol the command must follow.
+ * Return: stream/NULL if error.
+ */
+SO_FILE *so_popen_pool(const char *command, const char *type)
+{
+	SO_FILE *stream;
+
+	stream = alloc_stream(SO_BUFSIZE, 0);
+	if (stream == NULL)
+		return NULL;
+
+	if (strcmp(type, "r") == 0) {
+		stream->flags = O_RDONLY;
+	} else if (strcmp(type, "w") == 0) {
+		stream->flags = O_WRONLY;
+	} else {
+		errno = EINVAL;
+		free_stream(stream);
+		return NULL;
+	}
+
+	TRACE_START(start);
+	if (pool_open(stream, command) < 0) {
+		free_stream(stream);
+		return NULL;
+	}
+	TRACE_END(start, TRACE_POPEN, stream->fd, stream->pid);
+	registry_add(stream);
+
+	return stream;
+}
+
+/*
+ * Description: flushes a stream opened through so_popen_pool and returns
+ its worker to the pool.
+ * Return: status reported by the worker/-1 if fails.
+ */
+static int pclose_pool(SO_FILE *stream)
+{
+	int rc;
+
+	registry_remove(stream);
+	autoflush_free(stream);
+	if (stream->woffset != 0)
+		unload_wbuffer(stream);
+
+	/* A pooled worker keeps running, its status is in the response: */
+	TRACE_START(start);
+	rc = pool_close(stream);
+	TRACE_END(start, TRACE_PCLOSE, stream->fd, rc);
+	free_stream(stream);
+
+	return rc;
+}
+
+/*
+ * Description: flushes a stream opened through popen, closes its pipe
+ and frees it; the child is not waited for.
+ * Return: 0/SO_EOF if the write buffer could not be flushed.
+ */
+static int pclose_stream(SO_FILE *stream)
+{
+	int rc = 0;
+
+	registry_remove(stream);
+	autoflush_free(stream);
+
+	/* Pending data is written even if it has to wait for the pipe: */
+	if (stream->nonblock)
+		so_fsetnonblock(stream, 0);
+
+	if (stream->woffset != 0 && unload_wbuffer(stream) <= 0)
+		rc = SO_EOF;
+
+	close(stream->fd);
+	free_stream(stream);
+
+	return rc;
+}
+
 /*
  * Description: waits for child process, closes files and frees
  memory for stream opened through popen.
- * Return: 0 for no error/-1 error.
+ * Return: wait status of the child (as from waitpid)/-1 error.
  */
 int so_pclose(SO_FILE *stream)
 {
-	int status, rc;
 	int pid = stream->pid;
 	int fd = stream->fd;
+	int status, rc, ret;
 
-	/* Flush anything in write buffer: */
-	if (stream->woffset != 0) {
-		rc = unload_wbuffer(stream);
-		if (rc <= 0) {
-			free(stream);
-			return rc;
-		}
-	}
+	if (stream->pool != NULL)
+		return pclose_pool(stream);
 
-	free(stream);
-	close(fd);
+	ret = pclose_stream(stream);
 
-	rc = waitpid(pid, &status, 0);
-	if (rc < 0)
+	TRACE_START(start);
+	do {
+		rc = waitpid(pid, &status, 0);
+	} while (rc < 0 && errno == EINTR);
+	TRACE_END(start, TRACE_PCLOSE, fd, rc < 0 ? -1 : status);
+	if (rc < 0 || ret < 0)
 		return -1;
 
-	return 0;
+	return status;
+}
+
+/*
+ * Description: flushes and closes a stream opened through popen without
+ waiting for the child: it is reaped in the background and done (if not
+ NULL) is called from another thread with its wait status. For a pooled
+ stream, done is called before returning, with the worker status.
+ * Return: 0/SO_EOF if the write buffer could not be flushed.
+ */
+int so_pclose_async(SO_FILE *stream, so_reap_cb done, void *arg)
+{
+	int pid = stream->pid;
+	int rc;
+
+	if (stream->pool != NULL) {
+		rc = pclose_pool(stream);
+		if (done != NULL)
+			done(pid, rc, arg);
+		return rc < 0 ? SO_EOF : 0;
+	}
+
+	rc = pclose_stream(stream);
+	reaper_add(pid, done, arg);
+
+	return rc;
 }
@@ -8,7 +8,8 @@
 #define SO_STDIO_H
 
 #if defined(__linux__)
-#define FUNC_DECL_PREFIX
+/* The library is built with -fvisibility=hidden, only the API is exported */
+#define FUNC_DECL_PREFIX __attribute__((visibility("default")))
 #elif defined(_WIN32)
 #include <Windows.h>
 
@@ -23,6 +24,13 @@
 #endif
 
 #include <stdlib.h>
+#if defined(__linux__)
+#include <sys/types.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 #define SEEK_SET	0	/* Seek from beginning of file.  */
 #define SEEK_CUR	1	/* Seek from current position.  */
@@ -32,13 +40,97 @@
 
 #define SO_BUFSIZE	4096
 
+#define SO_TRACE_BINARY	0	/* Trace dump formats.  */
+#define SO_TRACE_CHROME	1
+
+#define SO_DURABLE_NONE		0	/* Durability modes.  */
+#define SO_DURABLE_FLUSH	1	/* fdatasync at every flush.  */
+#define SO_DURABLE_GROUP	2	/* fdatasync shared by flushers.  */
+
+#define SO_FILTER_UTF8		1	/* Input filters.  */
+#define SO_FILTER_CRLF		2	/* CRLF and CR become LF.  */
+
+#define SO_DIRECT_ALIGN		4096	/* Alignment of direct I/O.  */
+#define SO_DIRECT_BUFSIZE	(1 << 20)	/* Default direct buffer.  */
+
+/*
+ * Version of the public part of SO_FILE below. It changes whenever the
+ * layout of struct _so_file_buf or the meaning of its fields does, and
+ * it is the soname of the library (libso_stdio.so.N), so a program
+ * built against another version fails to load instead of misreading it.
+ */
+#define SO_STDIO_ABI_VERSION 1
+
 struct _so_file;
 
+/*
+ * Public prefix of every SO_FILE, used by the inline so_getc/so_putc.
+ * Bytes rbuffer[roffset, rsize) are buffered input and wbuffer may be
+ * filled up to wlimit; anything else is done by the library.
+ */
+struct _so_file_buf {
+	char *rbuffer;
+	int roffset;
+	int rsize;
+	char *wbuffer;
+	int woffset;
+	int wlimit;
+};
+
+/* I/O counters, kept per stream and aggregated per process */
+struct so_stats {
+	unsigned long long bytes_read;		/* bytes returned by read */
+	unsigned long long bytes_written;	/* bytes accepted by write */
+	unsigned long long syscalls;		/* read/write/lseek/... issued */
+	unsigned long long refills;		/* read buffer loads */
+	unsigned long long flushes;		/* write buffer unloads */
+	unsigned long long seeks_discarded;	/* seeks dropping read-ahead */
+	unsigned long long short_reads;
+	unsigned long long short_writes;
+	unsigned long long blocked_ns;		/* time spent in syscalls */
+};
+
+/* Field returned by so_fnextfield, valid until the next stream call */
+struct so_field {
+	const char *data;
+	size_t len;
+	int last;				/* 1 if it ends the record */
+};
+
+/* Length-prefixed record, see so_fwrite_record/so_fread_record */
+struct so_record {
+	const char *data;
+	size_t len;
+};
+
+/* Options of so_sort, zero fields take the defaults */
+struct so_sort_opts {
+	size_t record_size;			/* 0 sorts lines */
+	size_t memory;				/* 256 MiB */
+	unsigned int threads;			/* one per CPU */
+	const char *tmpdir;			/* /tmp */
+};
+
 typedef struct _so_file SO_FILE;
 
 FUNC_DECL_PREFIX SO_FILE *so_fopen(const char *pathname, const char *mode);
 FUNC_DECL_PREFIX int so_fclose(SO_FILE *stream);
 
+#if defined(__linux__)
+/* Cache-bypassing (O_DIRECT) stream, mode is "r" or "w" */
+FUNC_DECL_PREFIX SO_FILE *so_fopen_direct(const char *pathname,
+					  const char *mode, size_t bufsize);
+
+/* Opens n files for reading, with their first buffer loaded */
+FUNC_DECL_PREFIX size_t so_fopen_many(const char * const *paths, size_t n,
+				      SO_FILE **streams);
+
+/* Several files (or the matches of a glob) read as one stream */
+FUNC_DECL_PREFIX SO_FILE *so_fopen_concat(const char * const *paths,
+					  size_t n);
+FUNC_DECL_PREFIX SO_FILE *so_fopen_glob(const char *pattern);
+#endif
+
 #if defined(__linux__)
 FUNC_DECL_PREFIX int so_fileno(SO_FILE *stream);
 #elif defined(_WIN32)
@@ -50,6 +142,66 @@ FUNC_DECL_PREFIX HANDLE so_fileno(SO_FILE *stream);
 
 FUNC_DECL_PREFIX int so_fflush(SO_FILE *stream);
 
+#if defined(__linux__)
+/* Flushes every open stream; also done at exit */
+FUNC_DECL_PREFIX int so_fflushall(void);
+
+/* Must be called before any I/O on the stream */
+FUNC_DECL_PREFIX int so_setvbuf(SO_FILE *stream, size_t size);
+FUNC_DECL_PREFIX int so_fsetdurability(SO_FILE *stream, int mode,
+				       size_t writeback);
+
+/* Flush after bytes are buffered or the oldest one is usec old */
+FUNC_DECL_PREFIX int so_fsetautoflush(SO_FILE *stream, size_t bytes,
+				      unsigned int usec);
+
+/* Buffers grow from a process-wide budget; so_ftrim frees idle ones */
+FUNC_DECL_PREFIX size_t so_setbudget(size_t limit);
+FUNC_DECL_PREFIX int so_ftrim(SO_FILE *stream);
+
+/* Sparse index of line starts, persisted as pathname.soidx */
+FUNC_DECL_PREFIX int so_findex(SO_FILE *stream, unsigned int every,
+			       int background);
+FUNC_DECL_PREFIX int so_fseekline(SO_FILE *stream, unsigned long long line);
+
+/* Follow mode: EOF waits for the file to grow, like tail -F */
+FUNC_DECL_PREFIX int so_ffollow(SO_FILE *stream, int on);
+FUNC_DECL_PREFIX int so_ffollow_fd(SO_FILE *stream);
+
+/* Delimited records (CSV/TSV): 1 per field, 0 at EOF */
+FUNC_DECL_PREFIX int so_fnextfield(SO_FILE *stream, char delim,
+				   struct so_field *field);
+
+/* Records framed by a LEB128 length; read ones are valid until next call */
+FUNC_DECL_PREFIX int so_fwrite_record(SO_FILE *stream, const void *data,
+				      size_t len);
+FUNC_DECL_PREFIX size_t so_fwrite_records(SO_FILE *stream,
+					  const struct so_record *recs,
+					  size_t n);
+FUNC_DECL_PREFIX int so_fread_record(SO_FILE *stream, struct so_record *rec);
+FUNC_DECL_PREFIX size_t so_fread_records(SO_FILE *stream,
+					 struct so_record *recs, size_t n);
+
+/* UTF-8 validation and newline normalization of everything read */
+FUNC_DECL_PREFIX int so_fsetfilter(SO_FILE *stream, int flags);
+FUNC_DECL_PREFIX long long so_ferroroffset(SO_FILE *stream);
+
+/* External merge sort of a file, by line or fixed-size record */
+FUNC_DECL_PREFIX int so_sort(const char *input, const char *output,
+			     const struct so_sort_opts *opts);
+
+/* Non-blocking mode: operations that would block fail with EAGAIN */
+FUNC_DECL_PREFIX int so_fsetnonblock(SO_FILE *stream, int on);
+FUNC_DECL_PREFIX size_t so_fpending(SO_FILE *stream);
+
+/* Buffer hooks for I/O done outside the library, see so_stdio.hpp */
+FUNC_DECL_PREFIX ssize_t so_rbuffer_prepare(SO_FILE *stream, char **buf);
+FUNC_DECL_PREFIX ssize_t so_rbuffer_commit(SO_FILE *stream, ssize_t res);
+FUNC_DECL_PREFIX ssize_t so_wbuffer_prepare(SO_FILE *stream,
+					    const char **buf);
+FUNC_DECL_PREFIX ssize_t so_wbuffer_commit(SO_FILE *stream, ssize_t res);
+#endif
+
 FUNC_DECL_PREFIX int so_fseek(SO_FILE *stream, long offset, int whence);
 FUNC_DECL_PREFIX long so_ftell(SO_FILE *stream);
 
@@ -62,10 +214,62 @@ size_t so_fwrite(const void *ptr, size_t size, size_t nmemb, SO_FILE *stream);
 FUNC_DECL_PREFIX int so_fgetc(SO_FILE *stream);
 FUNC_DECL_PREFIX int so_fputc(int c, SO_FILE *stream);
 
+#if defined(__linux__)
+/* Same as so_fgetc, without a library call while input is buffered */
+static inline int so_getc(SO_FILE *stream)
+{
+	struct _so_file_buf *buf = (struct _so_file_buf *) stream;
+
+	if (__builtin_expect(buf->roffset < buf->rsize, 1))
+		return (unsigned char) buf->rbuffer[buf->roffset++];
+
+	return so_fgetc(stream);
+}
+
+/* Same as so_fputc, without a library call while wbuffer has room */
+static inline int so_putc(int c, SO_FILE *stream)
+{
+	struct _so_file_buf *buf = (struct _so_file_buf *) stream;
+
+	if (__builtin_expect(buf->woffset < buf->wlimit, 1)) {
+		buf->wbuffer[buf->woffset++] = (char) c;
+		return (unsigned char) c;
+	}
+
+	return so_fputc(c, stream);
+}
+#endif
+
 FUNC_DECL_PREFIX int so_feof(SO_FILE *stream);
 FUNC_DECL_PREFIX int so_ferror(SO_FILE *stream);
 
+#if defined(__linux__)
+FUNC_DECL_PREFIX int so_fstats(SO_FILE *stream, struct so_stats *stats);
+FUNC_DECL_PREFIX void so_stats_global(struct so_stats *stats);
+
+/* Only available if the library is built with SO_TRACE */
+FUNC_DECL_PREFIX int so_trace_enable(int on);
+FUNC_DECL_PREFIX int so_trace_dump(const char *pathname, int format);
+#endif
+
 FUNC_DECL_PREFIX SO_FILE *so_popen(const char *command, const char *type);
 FUNC_DECL_PREFIX int so_pclose(SO_FILE *stream);
 
+#if defined(__linux__)
+/* Called from a reaper thread once the child of so_pclose_async exits */
+typedef void (*so_reap_cb)(int pid, int status, void *arg);
+
+FUNC_DECL_PREFIX int so_pclose_async(SO_FILE *stream, so_reap_cb done,
+				     void *arg);
+
+/* Workers kept running between streams, speaking a framed protocol */
+FUNC_DECL_PREFIX SO_FILE *so_popen_pool(const char *command,
+					const char *type);
+FUNC_DECL_PREFIX int so_pool_clear(void);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* SO_STDIO_H */
@@ -0,0 +1,743 @@
+/*
+ * C++20 coroutine interface for so_stdio, over io_uring.
+ *
+ * An io_loop owns an io_uring instance and runs coroutines on the calling
+ * thread. The awaitables below keep using the SO_FILE buffers: data is
+ * copied to and from rbuffer/wbuffer exactly like so_fread/so_fwrite do,
+ * only the refill and the flush are submitted to io_uring (through
+ * so_rbuffer_prepare/commit and so_wbuffer_prepare/commit) instead of
+ * blocking in read/write. Each stream must be used by one coroutine at a
+ * time, always at the current file position.
+ *
+ *	so::task<void> copy(so::io_loop &loop, SO_FILE *in, SO_FILE *out)
+ *	{
+ *		std::string line;
+ *
+ *		while (co_await so::async_getline(loop, in, line))
+ *			co_await so::async_write(loop, out, line.data(),
+ *						 line.size());
+ *		co_await so::async_flush(loop, out);
+ *	}
+ *
+ *	loop.spawn(copy(loop, in, out));
+ *	loop.run();
+ *
+ * so::file owns a SO_FILE and so::so_streambuf lets std::istream and
+ * std::ostream work directly on its buffers.
+ */
+
+#ifndef SO_STDIO_HPP
+#define SO_STDIO_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <span>
+#include <streambuf>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "so_stdio.h"
+
+namespace so {
+
+/*
+ * Coroutine returning T, started when awaited (or by io_loop::spawn).
+ */
+template <typename T = void>
+class task;
+
+namespace detail {
+
+struct promise_base {
+	std::coroutine_handle<> continuation;
+	std::exception_ptr exception;
+
+	struct final_awaiter {
+		bool await_ready() noexcept { return false; }
+
+		template <typename P>
+		std::coroutine_handle<>
+		await_suspend(std::coroutine_handle<P> h) noexcept
+		{
+			auto next = h.promise().continuation;
+
+			return next ? next : std::noop_coroutine();
+		}
+
+		void await_resume() noexcept {}
+	};
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	final_awaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { exception = std::current_exception(); }
+};
+
+template <typename T>
+struct promise : promise_base {
+	T value{};
+
+	task<T> get_return_object();
+	void return_value(T v) { value = std::move(v); }
+
+	T result()
+	{
+		if (exception)
+			std::rethrow_exception(exception);
+		return std::move(value);
+	}
+};
+
+template <>
+struct promise<void> : promise_base {
+	task<void> get_return_object();
+	void return_void() {}
+
+	void result()
+	{
+		if (exception)
+			std::rethrow_exception(exception);
+	}
+};
+
+/* Coroutine that owns a spawned task and frees itself when done */
+struct detached {
+	struct promise_type {
+		detached get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+} /* namespace detail */
+
+template <typename T>
+class task {
+public:
+	using promise_type = detail::promise<T>;
+
+	explicit task(std::coroutine_handle<promise_type> h) : h_(h) {}
+	task(task &&other) noexcept : h_(std::exchange(other.h_, {})) {}
+	task(const task &) = delete;
+	task &operator=(const task &) = delete;
+
+	~task()
+	{
+		if (h_)
+			h_.destroy();
+	}
+
+	bool await_ready() const noexcept { return false; }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller)
+	{
+		h_.promise().continuation = caller;
+		return h_;
+	}
+
+	T await_resume() { return h_.promise().result(); }
+
+private:
+	std::coroutine_handle<promise_type> h_;
+};
+
+namespace detail {
+
+template <typename T>
+inline task<T> promise<T>::get_return_object()
+{
+	return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> promise<void>::get_return_object()
+{
+	return task<void>(
+		std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+} /* namespace detail */
+
+/*
+ * Event loop over an io_uring instance, driven by run() on one thread.
+ */
+class io_loop {
+public:
+	/* Awaitable for a single read or write submitted to the ring */
+	struct operation {
+		io_loop *loop;
+		int opcode;
+		int fd;
+		void *buf;
+		unsigned int len;
+		int result = 0;
+		std::coroutine_handle<> waiter = {};
+
+		bool await_ready() const noexcept { return false; }
+
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			waiter = h;
+			loop->submit(this);
+		}
+
+		int await_resume() const noexcept { return result; }
+	};
+
+	explicit io_loop(unsigned int entries = 256)
+	{
+		io_uring_params p;
+
+		std::memset(&p, 0, sizeof(p));
+		fd_ = syscall(__NR_io_uring_setup, entries, &p);
+		if (fd_ < 0)
+			throw std::system_error(errno, std::system_category(),
+						"io_uring_setup");
+
+		sq_len_ = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+		cq_len_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+			sq_len_ = cq_len_ = std::max(sq_len_, cq_len_);
+
+		sq_ring_ = map(sq_len_, IORING_OFF_SQ_RING);
+		cq_ring_ = (p.features & IORING_FEAT_SINGLE_MMAP) ?
+			   sq_ring_ : map(cq_len_, IORING_OFF_CQ_RING);
+		sqes_len_ = p.sq_entries * sizeof(io_uring_sqe);
+		sqes_ = static_cast<io_uring_sqe *>(
+			map(sqes_len_, IORING_OFF_SQES));
+
+		char *sq = static_cast<char *>(sq_ring_);
+		char *cq = static_cast<char *>(cq_ring_);
+
+		sq_head_ = reinterpret_cast<unsigned int *>(sq + p.sq_off.head);
+		sq_tail_ = reinterpret_cast<unsigned int *>(sq + p.sq_off.tail);
+		sq_mask_ = *reinterpret_cast<unsigned int *>(
+			sq + p.sq_off.ring_mask);
+		sq_array_ = reinterpret_cast<unsigned int *>(
+			sq + p.sq_off.array);
+		sq_entries_ = p.sq_entries;
+		cq_head_ = reinterpret_cast<unsigned int *>(cq + p.cq_off.head);
+		cq_tail_ = reinterpret_cast<unsigned int *>(cq + p.cq_off.tail);
+		cq_mask_ = *reinterpret_cast<unsigned int *>(
+			cq + p.cq_off.ring_mask);
+		cqes_ = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+		tail_ = *sq_tail_;
+	}
+
+	io_loop(const io_loop &) = delete;
+	io_loop &operator=(const io_loop &) = delete;
+
+	~io_loop()
+	{
+		munmap(sqes_, sqes_len_);
+		if (cq_ring_ != sq_ring_)
+			munmap(cq_ring_, cq_len_);
+		munmap(sq_ring_, sq_len_);
+		close(fd_);
+	}
+
+	/* Reads at the current file position; result is bytes or -errno */
+	operation read(int fd, void *buf, size_t len)
+	{
+		return { this, IORING_OP_READ, fd, buf, clamp(len) };
+	}
+
+	/* Writes at the current file position; result is bytes or -errno */
+	operation write(int fd, const void *buf, size_t len)
+	{
+		return { this, IORING_OP_WRITE, fd, const_cast<void *>(buf),
+			 clamp(len) };
+	}
+
+	/* Starts a task; it runs until its first suspension right away */
+	void spawn(task<void> t) { run_detached(std::move(t)); }
+
+	/* Runs until no operation is in flight */
+	void run()
+	{
+		while (inflight_ > 0) {
+			int rc = enter(pending_, 1, IORING_ENTER_GETEVENTS);
+
+			if (rc < 0 && errno != EINTR && errno != EBUSY)
+				throw std::system_error(errno,
+							std::system_category(),
+							"io_uring_enter");
+			if (rc > 0)
+				pending_ -= rc;
+			reap();
+		}
+	}
+
+private:
+	static detail::detached run_detached(task<void> t)
+	{
+		co_await std::move(t);
+	}
+
+	static unsigned int clamp(size_t len)
+	{
+		return len > 0x7ffff000 ? 0x7ffff000 : len;
+	}
+
+	void *map(size_t len, off_t offset)
+	{
+		void *p = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+			       MAP_SHARED | MAP_POPULATE, fd_, offset);
+
+		if (p == MAP_FAILED)
+			throw std::system_error(errno, std::system_category(),
+						"mmap io_uring");
+		return p;
+	}
+
+	int enter(unsigned int to_submit, unsigned int min_complete,
+		  unsigned int flags)
+	{
+		return syscall(__NR_io_uring_enter, fd_, to_submit,
+			       min_complete, flags, nullptr, 0);
+	}
+
+	void submit(operation *op)
+	{
+		/* Make room by handing queued entries to the kernel: */
+		while (tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) ==
+		       sq_entries_) {
+			int rc = enter(pending_, 0, 0);
+
+			if (rc > 0)
+				pending_ -= rc;
+			else if (rc < 0 && errno != EINTR && errno != EBUSY)
+				throw std::system_error(errno,
+							std::system_category(),
+							"io_uring_enter");
+			reap();
+		}
+
+		unsigned int index = tail_ & sq_mask_;
+		io_uring_sqe *sqe = &sqes_[index];
+
+		std::memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = op->opcode;
+		sqe->fd = op->fd;
+		sqe->addr = reinterpret_cast<uintptr_t>(op->buf);
+		sqe->len = op->len;
+		sqe->off = static_cast<uint64_t>(-1); /* file position */
+		sqe->user_data = reinterpret_cast<uintptr_t>(op);
+		sq_array_[index] = index;
+
+		__atomic_store_n(sq_tail_, ++tail_, __ATOMIC_RELEASE);
+		pending_++;
+		inflight_++;
+	}
+
+	void reap()
+	{
+		unsigned int head = *cq_head_;
+
+		while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+			io_uring_cqe *cqe = &cqes_[head & cq_mask_];
+			auto *op = reinterpret_cast<operation *>(cqe->user_data);
+
+			op->result = cqe->res;
+			__atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+			inflight_--;
+			op->waiter.resume();
+			head = *cq_head_;
+		}
+	}
+
+	int fd_;
+	void *sq_ring_;
+	void *cq_ring_;
+	size_t sq_len_;
+	size_t cq_len_;
+	io_uring_sqe *sqes_;
+	size_t sqes_len_;
+	unsigned int *sq_head_;
+	unsigned int *sq_tail_;
+	unsigned int *sq_array_;
+	unsigned int sq_mask_;
+	unsigned int sq_entries_;
+	unsigned int *cq_head_;
+	unsigned int *cq_tail_;
+	unsigned int cq_mask_;
+	io_uring_cqe *cqes_;
+	unsigned int tail_; /* local copy of the submission tail */
+	unsigned int pending_ = 0; /* queued, not yet submitted */
+	unsigned int inflight_ = 0; /* submitted, not yet completed */
+};
+
+/* Buffer prefix shared with the inline so_getc/so_putc */
+inline _so_file_buf *buffers(SO_FILE *stream)
+{
+	return reinterpret_cast<_so_file_buf *>(stream);
+}
+
+/*
+ * Refills the read buffer of a stream whose buffer was consumed.
+ * Returns bytes loaded, 0 at EOF or -errno.
+ */
+inline task<ssize_t> async_refill(io_loop &loop, SO_FILE *stream)
+{
+	char *area;
+	ssize_t len = so_rbuffer_prepare(stream, &area);
+
+	if (len < 0)
+		co_return -errno;
+
+	int res = co_await loop.read(so_fileno(stream), area, len);
+
+	co_return so_rbuffer_commit(stream, res);
+}
+
+/*
+ * Writes everything in the write buffer; the commit of the last bytes
+ * syncs the file if the stream is durable, as so_fflush does. Returns 0
+ * or -errno.
+ */
+inline task<int> async_flush(io_loop &loop, SO_FILE *stream)
+{
+	const char *data;
+	ssize_t len;
+
+	while ((len = so_wbuffer_prepare(stream, &data)) > 0) {
+		int res = co_await loop.write(so_fileno(stream), data, len);
+
+		if (so_wbuffer_commit(stream, res) < 0)
+			co_return res < 0 ? res : -errno;
+	}
+
+	co_return len < 0 ? -errno : 0;
+}
+
+/*
+ * Reads at most count bytes, like read(2): 0 at EOF, -errno on error.
+ */
+inline task<ssize_t> async_read(io_loop &loop, SO_FILE *stream, void *buf,
+				size_t count)
+{
+	_so_file_buf *b = buffers(stream);
+
+	if (count == 0)
+		co_return 0;
+
+	if (b->roffset == b->rsize) {
+		ssize_t res = co_await async_refill(loop, stream);
+
+		if (res <= 0)
+			co_return res;
+	}
+
+	size_t n = std::min<size_t>(count, b->rsize - b->roffset);
+
+	std::memcpy(buf, b->rbuffer + b->roffset, n);
+	b->roffset += n;
+
+	co_return n;
+}
+
+/*
+ * Buffers count bytes, flushing asynchronously whenever the buffer is
+ * full. Returns count or -errno.
+ */
+inline task<ssize_t> async_write(io_loop &loop, SO_FILE *stream,
+				 const void *buf, size_t count)
+{
+	_so_file_buf *b = buffers(stream);
+	const char *p = static_cast<const char *>(buf);
+	size_t done = 0;
+
+	while (done < count) {
+		if (b->woffset >= b->wlimit) {
+			int res = co_await async_flush(loop, stream);
+
+			if (res < 0)
+				co_return res;
+			/* so_fsetautoflush keeps wlimit at 0: */
+			if (b->wlimit == 0)
+				co_return -EINVAL;
+		}
+
+		size_t n = std::min<size_t>(count - done,
+					    b->wlimit - b->woffset);
+
+		std::memcpy(b->wbuffer + b->woffset, p + done, n);
+		b->woffset += n;
+		done += n;
+	}
+
+	co_return count;
+}
+
+/*
+ * Reads a line without its '\n' into line. Returns false at EOF (or on
+ * error) if nothing was read.
+ */
+inline task<bool> async_getline(io_loop &loop, SO_FILE *stream,
+				std::string &line)
+{
+	_so_file_buf *b = buffers(stream);
+	bool got = false;
+
+	line.clear();
+	for (;;) {
+		if (b->roffset == b->rsize) {
+			ssize_t res = co_await async_refill(loop, stream);
+
+			if (res <= 0)
+				co_return got;
+		}
+
+		const char *start = b->rbuffer + b->roffset;
+		size_t avail = b->rsize - b->roffset;
+		const char *nl = static_cast<const char *>(
+			std::memchr(start, '\n', avail));
+
+		got = true;
+		if (nl != nullptr) {
+			line.append(start, nl - start);
+			b->roffset += nl - start + 1;
+			co_return true;
+		}
+
+		line.append(start, avail);
+		b->roffset += avail;
+	}
+}
+
+/*
+ * Owner of a SO_FILE, closed (so_fclose or so_pclose) on destruction.
+ */
+class file {
+public:
+	file() = default;
+	explicit file(SO_FILE *stream, bool pipe = false)
+		: stream_(stream), pipe_(pipe) {}
+
+	file(file &&other) noexcept
+		: stream_(std::exchange(other.stream_, nullptr)),
+		  pipe_(other.pipe_) {}
+
+	file &operator=(file &&other) noexcept
+	{
+		if (this != &other) {
+			close();
+			stream_ = std::exchange(other.stream_, nullptr);
+			pipe_ = other.pipe_;
+		}
+		return *this;
+	}
+
+	file(const file &) = delete;
+	file &operator=(const file &) = delete;
+
+	~file() { close(); }
+
+	static file open(const char *pathname, const char *mode)
+	{
+		SO_FILE *stream = so_fopen(pathname, mode);
+
+		if (stream == nullptr)
+			throw std::system_error(errno, std::system_category(),
+						pathname);
+		return file(stream);
+	}
+
+	static file popen(const char *command, const char *type)
+	{
+		SO_FILE *stream = so_popen(command, type);
+
+		if (stream == nullptr)
+			throw std::system_error(errno, std::system_category(),
+						command);
+		return file(stream, true);
+	}
+
+	/* Closes the stream; returns the so_fclose/so_pclose result */
+	int close()
+	{
+		SO_FILE *stream = std::exchange(stream_, nullptr);
+
+		if (stream == nullptr)
+			return 0;
+		return pipe_ ? so_pclose(stream) : so_fclose(stream);
+	}
+
+	SO_FILE *get() const noexcept { return stream_; }
+	SO_FILE *release() noexcept { return std::exchange(stream_, nullptr); }
+	explicit operator bool() const noexcept { return stream_ != nullptr; }
+
+	/* Input already in the read buffer, not consumed yet */
+	std::span<const std::byte> buffered_input() const noexcept
+	{
+		_so_file_buf *b = buffers(stream_);
+
+		return { reinterpret_cast<const std::byte *>(b->rbuffer) +
+			 b->roffset, static_cast<size_t>(b->rsize - b->roffset) };
+	}
+
+	/* Marks n bytes of buffered_input() as consumed */
+	void consume(size_t n) noexcept
+	{
+		buffers(stream_)->roffset += n;
+	}
+
+	/* Output waiting in the write buffer */
+	std::span<const std::byte> pending_output() const noexcept
+	{
+		_so_file_buf *b = buffers(stream_);
+
+		return { reinterpret_cast<const std::byte *>(b->wbuffer),
+			 static_cast<size_t>(b->woffset) };
+	}
+
+private:
+	SO_FILE *stream_ = nullptr;
+	bool pipe_ = false;
+};
+
+/*
+ * std::streambuf whose get and put areas are the rbuffer and wbuffer of
+ * a SO_FILE, so iostreams read and write them without another copy. The
+ * offsets of the stream are brought up to date before every call into
+ * the library; call pubsync() before using the stream through the C API
+ * again. The stream is not owned.
+ */
+class so_streambuf : public std::streambuf {
+public:
+	explicit so_streambuf(SO_FILE *stream) : stream_(stream) { reset(); }
+	explicit so_streambuf(file &f) : so_streambuf(f.get()) {}
+
+	so_streambuf(const so_streambuf &) = delete;
+	so_streambuf &operator=(const so_streambuf &) = delete;
+
+	~so_streambuf() override { sync(); }
+
+	SO_FILE *stream() const noexcept { return stream_; }
+
+protected:
+	int_type underflow() override
+	{
+		commit();
+
+		/* so_fgetc refills; the byte stays in the buffer: */
+		int c = so_fgetc(stream_);
+
+		if (c == SO_EOF) {
+			reset();
+			return traits_type::eof();
+		}
+		buffers(stream_)->roffset--;
+		reset();
+
+		return traits_type::to_int_type(*gptr());
+	}
+
+	int_type overflow(int_type c) override
+	{
+		commit();
+		if (!traits_type::eq_int_type(c, traits_type::eof()) &&
+		    so_fputc(traits_type::to_char_type(c), stream_) == SO_EOF) {
+			reset();
+			return traits_type::eof();
+		}
+		reset();
+
+		return traits_type::not_eof(c);
+	}
+
+	std::streamsize xsgetn(char_type *s, std::streamsize n) override
+	{
+		commit();
+		std::streamsize got = so_fread(s, 1, n, stream_);
+		reset();
+
+		return got;
+	}
+
+	std::streamsize xsputn(const char_type *s, std::streamsize n) override
+	{
+		commit();
+		std::streamsize put = so_fwrite(s, 1, n, stream_);
+		reset();
+
+		return put;
+	}
+
+	int sync() override
+	{
+		commit();
+		int rc = so_fflush(stream_);
+		reset();
+
+		return rc == 0 ? 0 : -1;
+	}
+
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+			 std::ios_base::openmode) override
+	{
+		int whence = dir == std::ios_base::beg ? SEEK_SET :
+			     dir == std::ios_base::cur ? SEEK_CUR : SEEK_END;
+
+		commit();
+		if (!(dir == std::ios_base::cur && off == 0) &&
+		    so_fseek(stream_, off, whence) != 0) {
+			reset();
+			return pos_type(off_type(-1));
+		}
+		reset();
+
+		return pos_type(so_ftell(stream_));
+	}
+
+	pos_type seekpos(pos_type pos, std::ios_base::openmode which) override
+	{
+		return seekoff(off_type(pos), std::ios_base::beg, which);
+	}
+
+private:
+	/* Stores the positions of the areas into the stream */
+	void commit()
+	{
+		_so_file_buf *b = buffers(stream_);
+
+		if (eback() != nullptr)
+			b->roffset = gptr() - eback();
+		if (pbase() != nullptr)
+			b->woffset = pptr() - pbase();
+	}
+
+	/* Points the areas at the (possibly new) stream buffers */
+	void reset()
+	{
+		_so_file_buf *b = buffers(stream_);
+
+		setg(b->rbuffer, b->rbuffer + b->roffset,
+		     b->rbuffer + b->rsize);
+		/* Autoflush streams (wlimit 0) take every byte through the
+		 * library, which may flush from another thread: */
+		if (b->wlimit != 0) {
+			setp(b->wbuffer, b->wbuffer + b->wlimit);
+			pbump(b->woffset);
+		} else {
+			setp(nullptr, nullptr);
+		}
+	}
+
+	SO_FILE *stream_;
+};
+
+} /* namespace so */
+
+#endif /* SO_STDIO_HPP */
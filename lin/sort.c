@@ -0,0 +1,104 @@
+/*
+ * Sorts a file that may be larger than memory with so_sort, bytewise (like
+ * LC_ALL=C sort), by line or by fixed-size record (-r).
+ *
+ *   so_sort [-r record_size] [-m memory] [-j threads] [-T tmpdir] [-v]
+ *           input output
+ *
+ * Sizes take the K, M and G suffixes. -v prints the time taken and the
+ * library counters to stderr.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "so_stdio.h"
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Description: parses a size with an optional K, M or G suffix.
+ */
+static size_t parse_size(const char *s)
+{
+	char *end;
+	size_t n = strtoull(s, &end, 0);
+
+	switch (*end) {
+	case 'G': case 'g':
+		n <<= 10;
+		/* fall through */
+	case 'M': case 'm':
+		n <<= 10;
+		/* fall through */
+	case 'K': case 'k':
+		n <<= 10;
+	}
+
+	return n;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-r record_size] [-m memory] [-j threads] "
+		"[-T tmpdir] [-v] input output\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct so_sort_opts opts = { 0 };
+	struct so_stats stats;
+	int opt, verbose = 0;
+	double start;
+
+	while ((opt = getopt(argc, argv, "r:m:j:T:v")) != -1) {
+		switch (opt) {
+		case 'r':
+			opts.record_size = parse_size(optarg);
+			break;
+		case 'm':
+			opts.memory = parse_size(optarg);
+			break;
+		case 'j':
+			opts.threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			opts.tmpdir = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2)
+		usage(argv[0]);
+
+	start = now();
+	if (so_sort(argv[optind], argv[optind + 1], &opts) != 0) {
+		perror("so_sort");
+		return EXIT_FAILURE;
+	}
+
+	if (verbose) {
+		fprintf(stderr, "sorted in %.3f s\n", now() - start);
+		so_stats_global(&stats);
+		fprintf(stderr, "read %llu bytes, wrote %llu bytes, "
+			"%llu syscalls, %.3f s blocked\n", stats.bytes_read,
+			stats.bytes_written, stats.syscalls,
+			stats.blocked_ns / 1e9);
+	}
+
+	return 0;
+}
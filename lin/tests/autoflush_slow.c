@@ -0,0 +1,96 @@
+/*
+ * Autoflush with a slow consumer: a pipe nobody reads (full, or with a
+ writer blocked on it) must not hold back the latency bound of the other
+ streams sharing the timer thread.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "so_stdio.h"
+
+#define BIG (1 << 20)
+
+static char path[] = "/tmp/so_autoflush_test.XXXXXX";
+
+static void *writer(void *arg)
+{
+	static char big[BIG];
+
+	so_fwrite(big, 1, sizeof(big), arg);
+
+	return NULL;
+}
+
+/*
+ * Description: writes a byte to the file, with a latency bound of 1 ms.
+ * Return: 0/1 if it is not in the file 200 ms later.
+ */
+static int bounded(void)
+{
+	SO_FILE *stream = so_fopen(path, "w");
+	struct stat st;
+	int rc;
+
+	if (stream == NULL || so_fsetautoflush(stream, 0, 1000) != 0)
+		return 1;
+	so_fputc('x', stream);
+	usleep(200000);
+	rc = stat(path, &st) != 0 || st.st_size != 1;
+	so_fclose(stream);
+
+	return rc;
+}
+
+int main(void)
+{
+	SO_FILE *full, *busy;
+	pthread_t thread;
+	int fd, size, i;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return 1;
+	close(fd);
+
+	/* A pipe filled to the brim, with a byte waiting for the timer: */
+	full = so_popen("sleep 2; cat >/dev/null", "w");
+	if (full == NULL)
+		return 1;
+	size = fcntl(so_fileno(full), F_GETPIPE_SZ);
+	for (i = 0; i < size; i++)
+		so_fputc('x', full);
+	if (so_fflush(full) != 0 || so_fsetautoflush(full, 0, 1000) != 0)
+		return 1;
+	so_fputc('x', full);
+	usleep(10000);
+
+	if (bounded() != 0) {
+		fprintf(stderr, "stalled by a full pipe\n");
+		return 1;
+	}
+
+	/* A writer blocked on its pipe, with the stream locked: */
+	busy = so_popen("sleep 2; cat >/dev/null", "w");
+	if (busy == NULL || so_fsetautoflush(busy, 0, 50000) != 0)
+		return 1;
+	so_fputc('x', busy);
+	pthread_create(&thread, NULL, writer, busy);
+	usleep(100000);
+
+	if (bounded() != 0) {
+		fprintf(stderr, "stalled by a locked stream\n");
+		return 1;
+	}
+
+	pthread_join(thread, NULL);
+	if (so_pclose(busy) != 0 || so_pclose(full) != 0)
+		return 1;
+	unlink(path);
+
+	return 0;
+}
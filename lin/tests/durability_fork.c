@@ -0,0 +1,121 @@
+/*
+ * Group commits across fork: a child forked while another thread leads a
+ group fdatasync must be able to flush durably itself. Also checks that
+ writeback windows follow seeks: the file must read back as written.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "so_stdio.h"
+
+static char path[] = "/tmp/so_durability_test.XXXXXX";
+static volatile int stop;
+
+static void *flusher(void *arg)
+{
+	SO_FILE *stream = so_fopen(path, "a");
+
+	if (stream == NULL ||
+	    so_fsetdurability(stream, SO_DURABLE_GROUP, 0) != 0)
+		exit(1);
+	while (!stop) {
+		so_fputc('x', stream);
+		if (so_fflush(stream) != 0)
+			exit(1);
+	}
+	so_fclose(stream);
+
+	return NULL;
+}
+
+/*
+ * Description: child: one group flush, killed by SIGALRM if it hangs.
+ */
+static int child(void)
+{
+	SO_FILE *stream;
+
+	alarm(5);
+	stream = so_fopen(path, "a");
+	if (stream == NULL ||
+	    so_fsetdurability(stream, SO_DURABLE_GROUP, 0) != 0)
+		return 1;
+	so_fputc('c', stream);
+
+	return so_fclose(stream) != 0;
+}
+
+/*
+ * Description: writes blocks at scattered offsets with small writeback
+ windows, then checks every block.
+ * Return: 0/1 if the file differs.
+ */
+static int seek_windows(void)
+{
+	static char block[8192], back[8192];
+	SO_FILE *stream = so_fopen(path, "w+");
+	int i, rc = 0;
+
+	if (stream == NULL ||
+	    so_fsetdurability(stream, SO_DURABLE_FLUSH, 16384) != 0)
+		return 1;
+	for (i = 0; i < 64; i++) {
+		memset(block, 'a' + i % 26, sizeof(block));
+		so_fseek(stream, (long) ((i * 37) % 64) * sizeof(block),
+			 SEEK_SET);
+		so_fwrite(block, 1, sizeof(block), stream);
+	}
+	if (so_fflush(stream) != 0 || so_ferror(stream))
+		rc = 1;
+
+	for (i = 0; i < 64 && rc == 0; i++) {
+		memset(block, 'a' + i % 26, sizeof(block));
+		so_fseek(stream, (long) ((i * 37) % 64) * sizeof(block),
+			 SEEK_SET);
+		if (so_fread(back, 1, sizeof(back), stream) != sizeof(back) ||
+		    memcmp(block, back, sizeof(block)) != 0)
+			rc = 1;
+	}
+	so_fclose(stream);
+
+	return rc;
+}
+
+int main(void)
+{
+	pthread_t threads[2];
+	int fd, i, pid, status, rc = 0;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return 1;
+	close(fd);
+
+	for (i = 0; i < 2; i++)
+		pthread_create(&threads[i], NULL, flusher, NULL);
+	for (i = 0; i < 50 && rc == 0; i++) {
+		pid = fork();
+		if (pid == 0)
+			_exit(child());
+		if (pid < 0 || waitpid(pid, &status, 0) < 0 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "child %d failed: %#x\n", i, status);
+			rc = 1;
+		}
+	}
+	stop = 1;
+	for (i = 0; i < 2; i++)
+		pthread_join(threads[i], NULL);
+
+	if (rc == 0 && seek_windows() != 0) {
+		fprintf(stderr, "writeback windows: file differs\n");
+		rc = 1;
+	}
+	unlink(path);
+
+	return rc;
+}
@@ -0,0 +1,62 @@
+/*
+ * so_pclose_async across fork: the child must get a reaper of its own
+ instead of adding its children to the epoll instance of the parent,
+ whose reaper thread would then free memory of the child.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "so_stdio.h"
+
+static volatile int reaped;
+
+static void done(int pid, int status, void *arg)
+{
+	reaped = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/*
+ * Description: starts "true" and closes it in the background, then waits
+ for the callback.
+ * Return: 0/1 if it did not run within 5 seconds.
+ */
+static int pclose_async(void)
+{
+	SO_FILE *stream = so_popen("true", "r");
+	int i;
+
+	reaped = 0;
+	if (stream == NULL || so_pclose_async(stream, done, NULL) < 0)
+		return 1;
+	for (i = 0; i < 500 && !reaped; i++)
+		usleep(10000);
+
+	return !reaped;
+}
+
+int main(void)
+{
+	int pid, status, round;
+
+	for (round = 0; round < 20; round++) {
+		if (pclose_async() != 0) {
+			fprintf(stderr, "parent callback not called\n");
+			return 1;
+		}
+
+		pid = fork();
+		if (pid < 0)
+			return 1;
+		if (pid == 0)
+			_exit(pclose_async());
+
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "child failed: %#x\n", status);
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * so_sort against LC_ALL=C sort: one pass, several merge passes (more
+ than SORT_FANIN runs) and two sorts running at once in one process,
+ sharing the directory of their runs, which must be left empty.
+ */
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "so_stdio.h"
+
+static char dir[] = "/tmp/so_sort_test.XXXXXX";
+
+struct sort_case {
+	const char *name;
+	size_t lines;
+	size_t memory;
+	unsigned int threads;
+	int rc;
+};
+
+/*
+ * Description: writes random lines (some empty, some repeated) to path.
+ */
+static void make_input(const char *path, size_t lines, unsigned int seed)
+{
+	FILE *f = fopen(path, "w");
+	size_t i;
+	int j, len;
+
+	for (i = 0; i < lines; i++) {
+		len = rand_r(&seed) % 40;
+		for (j = 0; j < len; j++)
+			fputc(rand_r(&seed) % 4 ? 'a' + rand_r(&seed) % 26 :
+			      ' ' + rand_r(&seed) % 95, f);
+		fputc('\n', f);
+	}
+	fclose(f);
+}
+
+/*
+ * Description: sorts the input of a case with so_sort and with sort;
+ c->rc is set to 1 if a sort fails or the outputs differ.
+ */
+static void *run_case(void *arg)
+{
+	struct sort_case *c = arg;
+	struct so_sort_opts opts = { 0 };
+	char in[256], out[256], ref[256], cmd[4 * 256 + 64];
+
+	snprintf(in, sizeof(in), "%s/%s.in", dir, c->name);
+	snprintf(out, sizeof(out), "%s/%s.out", dir, c->name);
+	snprintf(ref, sizeof(ref), "%s/%s.ref", dir, c->name);
+	make_input(in, c->lines, c->lines);
+
+	opts.memory = c->memory;
+	opts.threads = c->threads;
+	opts.tmpdir = dir;
+	c->rc = 1;
+	if (so_sort(in, out, &opts) != 0) {
+		perror(c->name);
+		return NULL;
+	}
+
+	snprintf(cmd, sizeof(cmd), "LC_ALL=C sort %s > %s && cmp %s %s",
+		 in, ref, ref, out);
+	c->rc = system(cmd) != 0;
+	unlink(in);
+	unlink(out);
+	unlink(ref);
+
+	return NULL;
+}
+
+int main(void)
+{
+	struct sort_case one = { "one", 20000, 64 << 20, 2 };
+	struct sort_case multi = { "multi", 100000, 8192, 1 };
+	struct sort_case a = { "a", 100000, 32768, 2 };
+	struct sort_case b = { "b", 100000, 32768, 2 };
+	pthread_t ta, tb;
+	struct dirent *de;
+	DIR *d;
+	int rc = 0;
+
+	if (mkdtemp(dir) == NULL)
+		return 1;
+
+	run_case(&one);
+	run_case(&multi);
+	pthread_create(&ta, NULL, run_case, &a);
+	pthread_create(&tb, NULL, run_case, &b);
+	pthread_join(ta, NULL);
+	pthread_join(tb, NULL);
+	if (one.rc || multi.rc || a.rc || b.rc) {
+		fprintf(stderr, "differ: one %d multi %d a %d b %d\n",
+			one.rc, multi.rc, a.rc, b.rc);
+		rc = 1;
+	}
+
+	/* Every run must be gone: */
+	d = opendir(dir);
+	while (d != NULL && (de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		fprintf(stderr, "left behind: %s\n", de->d_name);
+		rc = 1;
+	}
+	if (d != NULL)
+		closedir(d);
+	rmdir(dir);
+
+	return rc;
+}
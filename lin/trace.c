@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+
+#include "utils.h"
+#include "trace.h"
+#include "so_stdio.h"
+
+#ifdef SO_TRACE
+
+#define TRACE_RING_SIZE 4096 /* events kept per thread, power of 2 */
+#define TRACE_CHUNK 65536 /* size of the dump output buffer */
+
+/*
+ * Structure for a recorded event.
+ */
+struct trace_event {
+	uint64_t start_ns; /* monotonic start time */
+	uint64_t dur_ns; /* duration */
+	int64_t arg; /* bytes transferred, offset, pid or status */
+	int32_t type; /* enum trace_type */
+	int32_t fd; /* file descriptor of the stream */
+};
+
+/*
+ * Structure for a per-thread ring buffer. Only its thread writes events,
+ so recording needs no locks; head is published with release semantics
+ for the dumper. seq[i] is the number of the event in slot i plus one, 0
+ while it is being written, so the dumper can tell a torn copy. Rings are
+ never freed, so events of exited threads can still be dumped.
+ */
+struct trace_ring {
+	struct trace_ring *next; /* next ring in the list of all rings */
+	int tid; /* owner thread */
+	uint64_t head; /* number of events ever recorded */
+	uint64_t seq[TRACE_RING_SIZE];
+	struct trace_event events[TRACE_RING_SIZE];
+};
+
+int trace_enabled;
+
+static struct trace_ring *rings; /* lock-free list of all rings */
+static __thread struct trace_ring *my_ring;
+
+static const char * const trace_names[TRACE_NTYPES] = {
+	"open", "refill", "flush", "seek", "popen", "pclose"
+};
+
+/*
+ * Description: allocates the ring of the calling thread and pushes it to
+ the list of rings.
+ * Return: ring/NULL if memory allocation fails.
+ */
+static struct trace_ring *new_ring(void)
+{
+	struct trace_ring *ring = calloc(1, sizeof(*ring));
+
+	if (ring == NULL)
+		return NULL;
+
+	ring->tid = syscall(SYS_gettid);
+	ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 1,
+					    __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED))
+		;
+
+	return ring;
+}
+
+/*
+ * Description: records an event that started at start_ns and ends now.
+ */
+void trace_record(int type, unsigned long long start_ns, int fd, long arg)
+{
+	struct trace_ring *ring = my_ring;
+	struct trace_event *ev;
+	uint64_t slot;
+
+	if (ring == NULL) {
+		ring = my_ring = new_ring();
+		if (ring == NULL)
+			return;
+	}
+
+	slot = ring->head & (TRACE_RING_SIZE - 1);
+	__atomic_store_n(&ring->seq[slot], 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	ev = &ring->events[slot];
+	ev->start_ns = start_ns;
+	ev->dur_ns = now_ns() - start_ns;
+	ev->arg = arg;
+	ev->type = type;
+	ev->fd = fd;
+	__atomic_store_n(&ring->seq[slot], ring->head + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Description: appends len bytes to the dump buffer, writing it to fd
+ when full.
+ * Return: 0/-1 if write fails.
+ */
+static int dump_append(int fd, char *buf, int *used, const void *data,
+		       int len)
+{
+	if (*used + len > TRACE_CHUNK) {
+		if (xwrite(fd, buf, *used, NULL) < 0)
+			return -1;
+		*used = 0;
+	}
+
+	memcpy(buf + *used, data, len);
+	*used += len;
+
+	return 0;
+}
+
+/*
+ * Description: copies event i of a ring, seqlock style: the copy is kept
+ only if the slot held event i both before and after it was taken, so an
+ event the owner thread overwrote meanwhile is never returned torn.
+ * Return: 1/0 if the slot was reused.
+ */
+static int copy_event(struct trace_ring *ring, uint64_t i,
+		      struct trace_event *copy)
+{
+	uint64_t slot = i & (TRACE_RING_SIZE - 1);
+
+	if (__atomic_load_n(&ring->seq[slot], __ATOMIC_ACQUIRE) != i + 1)
+		return 0;
+	*copy = ring->events[slot];
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&ring->seq[slot], __ATOMIC_RELAXED) == i + 1;
+}
+
+/*
+ * Description: writes the events of one ring. Events that the owner
+ thread overwrote while they were copied are dropped.
+ * Return: 0/-1 if write fails.
+ */
+static int dump_ring(int fd, char *buf, int *used, struct trace_ring *ring,
+		     struct trace_event *copy, int format, int *first)
+{
+	uint64_t head, tail, i;
+	char valid[TRACE_RING_SIZE];
+	char line[256];
+	int len;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	tail = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+	for (i = tail; i < head; i++)
+		valid[i & (TRACE_RING_SIZE - 1)] =
+			copy_event(ring, i, &copy[i & (TRACE_RING_SIZE - 1)]);
+
+	for (i = tail; i < head; i++) {
+		struct trace_event *ev = &copy[i & (TRACE_RING_SIZE - 1)];
+
+		if (!valid[i & (TRACE_RING_SIZE - 1)] ||
+		    ev->type < 0 || ev->type >= TRACE_NTYPES)
+			continue;
+
+		if (format == SO_TRACE_BINARY) {
+			int32_t tid = ring->tid;
+
+			if (dump_append(fd, buf, used, &tid, sizeof(tid)) < 0 ||
+			    dump_append(fd, buf, used, ev, sizeof(*ev)) < 0)
+				return -1;
+			continue;
+		}
+
+		len = snprintf(line, sizeof(line),
+			       "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+			       "\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+			       "\"args\":{\"fd\":%d,\"arg\":%lld}}",
+			       *first ? "\n" : ",\n", trace_names[ev->type],
+			       ev->start_ns / 1000.0, ev->dur_ns / 1000.0,
+			       getpid(), ring->tid, ev->fd,
+			       (long long) ev->arg);
+		*first = 0;
+		if (dump_append(fd, buf, used, line, len) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Description: turns event recording on or off.
+ * Return: 0.
+ */
+int so_trace_enable(int on)
+{
+	__atomic_store_n(&trace_enabled, on != 0, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+ * Description: writes the events of all threads to a file, either in
+ binary form (SO_TRACE_BINARY: "SOTRACE1" magic, then a 32 bit thread ID
+ followed by a struct trace_event per event) or as Chrome trace JSON
+ (SO_TRACE_CHROME). Events keep being recorded meanwhile.
+ * Return: 0/-1 if the file can not be written.
+ */
+int so_trace_dump(const char *pathname, int format)
+{
+	static const char header[] = "{\"traceEvents\":[";
+	static const char footer[] = "\n]}\n";
+	struct trace_event *copy;
+	struct trace_ring *ring;
+	int fd, used = 0, first = 1, rc = 0;
+	char *buf;
+
+	if (format != SO_TRACE_BINARY && format != SO_TRACE_CHROME) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	buf = malloc(TRACE_CHUNK);
+	copy = malloc(TRACE_RING_SIZE * sizeof(*copy));
+	if (buf == NULL || copy == NULL)
+		goto fail;
+
+	fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto fail;
+
+	if (format == SO_TRACE_BINARY)
+		rc = dump_append(fd, buf, &used, "SOTRACE1", 8);
+	else
+		rc = dump_append(fd, buf, &used, header, sizeof(header) - 1);
+
+	ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+	for (; ring != NULL && rc == 0; ring = ring->next)
+		rc = dump_ring(fd, buf, &used, ring, copy, format, &first);
+
+	if (rc == 0 && format == SO_TRACE_CHROME)
+		rc = dump_append(fd, buf, &used, footer, sizeof(footer) - 1);
+	if (rc == 0 && used > 0 && xwrite(fd, buf, used, NULL) < 0)
+		rc = -1;
+
+	if (close(fd) < 0)
+		rc = -1;
+	free(copy);
+	free(buf);
+
+	return rc;
+
+fail:
+	free(copy);
+	free(buf);
+	return -1;
+}
+
+#else
+
+/*
+ * Tracing is compiled out: the API exists but can not be turned on.
+ */
+int so_trace_enable(int on)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int so_trace_dump(const char *pathname, int format)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * Event tracing. Events are recorded only if the library is built with
+ SO_TRACE (make TRACE=1) and tracing was enabled with so_trace_enable.
+ When disabled, a trace point costs one predictable branch.
+ */
+
+enum trace_type {
+	TRACE_OPEN,
+	TRACE_REFILL,
+	TRACE_FLUSH,
+	TRACE_SEEK,
+	TRACE_POPEN,
+	TRACE_PCLOSE,
+	TRACE_NTYPES
+};
+
+#ifdef SO_TRACE
+
+extern int trace_enabled;
+
+void trace_record(int type, unsigned long long start_ns, int fd, long arg);
+
+/* Starts a span: var holds the start time, or 0 if tracing is off */
+#define TRACE_START(var)						\
+	unsigned long long var = __builtin_expect(trace_enabled, 0) ?	\
+				 now_ns() : 0
+
+/* Ends a span started by TRACE_START */
+#define TRACE_END(var, type, fd, arg)					\
+	do {								\
+		if (__builtin_expect(var != 0, 0))			\
+			trace_record(type, var, fd, arg);		\
+	} while (0)
+
+#else
+
+#define TRACE_START(var)	do { } while (0)
+#define TRACE_END(var, type, fd, arg)	do { (void) (fd); } while (0)
+
+#endif
+
+#endif
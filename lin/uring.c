@@ -0,0 +1,157 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "utils.h"
+#include "uring.h"
+
+static void *uring_map(int fd, size_t len, off_t offset)
+{
+	return mmap(NULL, len, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, fd, offset);
+}
+
+/*
+ * Description: sets up a ring with room for entries submissions.
+ * Return: 0/-1 if io_uring is not available.
+ */
+int uring_init(struct uring *ring, unsigned int entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		return -1;
+
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_len = p.cq_off.cqes +
+		       p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_len > ring->sq_len)
+			ring->sq_len = ring->cq_len;
+		ring->cq_len = ring->sq_len;
+	}
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ring = uring_map(ring->fd, ring->sq_len, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto fail;
+	ring->cq_ring = ring->sq_ring;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		ring->cq_ring = uring_map(ring->fd, ring->cq_len,
+					  IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto fail_sq;
+	}
+	ring->sqes = uring_map(ring->fd, ring->sqes_len, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto fail_cq;
+
+	sq = ring->sq_ring;
+	cq = ring->cq_ring;
+	ring->sq_head = (unsigned int *) (sq + p.sq_off.head);
+	ring->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+	ring->sq_mask = *(unsigned int *) (sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *) (sq + p.sq_off.array);
+	ring->sq_entries = p.sq_entries;
+	ring->cq_head = (unsigned int *) (cq + p.cq_off.head);
+	ring->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+	ring->cq_mask = *(unsigned int *) (cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	ring->tail = *ring->sq_tail;
+
+	return 0;
+
+fail_cq:
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_len);
+fail_sq:
+	munmap(ring->sq_ring, ring->sq_len);
+fail:
+	close(ring->fd);
+	return -1;
+}
+
+/*
+ * Description: tears down a ring.
+ */
+void uring_exit(struct uring *ring)
+{
+	munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_len);
+	munmap(ring->sq_ring, ring->sq_len);
+	close(ring->fd);
+}
+
+/*
+ * Description: queues a zeroed submission entry, for the caller to fill.
+ * Return: entry/NULL if the submission queue is full.
+ */
+struct io_uring_sqe *uring_sqe(struct uring *ring)
+{
+	unsigned int index;
+	struct io_uring_sqe *sqe;
+
+	if (ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) ==
+	    ring->sq_entries)
+		return NULL;
+
+	index = ring->tail & ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+	ring->tail++;
+	ring->queued++;
+
+	return sqe;
+}
+
+/*
+ * Description: hands the queued entries to the kernel and waits until
+ at least wait completions are available.
+ * Return: 0/-1 if fails.
+ */
+int uring_submit_wait(struct uring *ring, unsigned int wait)
+{
+	int rc;
+
+	__atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+	for (;;) {
+		rc = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait,
+			     wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		ring->queued -= rc;
+		if (ring->queued == 0)
+			return 0;
+	}
+}
+
+/*
+ * Description: peeks at the next completion.
+ * Return: completion/NULL if there is none.
+ */
+struct io_uring_cqe *uring_cqe(struct uring *ring)
+{
+	unsigned int head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+/*
+ * Description: consumes the completion returned by uring_cqe.
+ */
+void uring_cqe_seen(struct uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,33 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring, used through raw syscalls (no liburing).
+ */
+
+/*
+ * Structure for a ring, owned by a single thread.
+ */
+struct uring {
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_array, sq_mask, sq_entries;
+	unsigned int *cq_head, *cq_tail, cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned int tail; /* local copy of the submission tail */
+	unsigned int queued; /* entries not yet handed to the kernel */
+
+	void *sq_ring, *cq_ring; /* mappings */
+	size_t sq_len, cq_len, sqes_len;
+};
+
+int uring_init(struct uring *ring, unsigned int entries);
+void uring_exit(struct uring *ring);
+struct io_uring_sqe *uring_sqe(struct uring *ring);
+int uring_submit_wait(struct uring *ring, unsigned int wait);
+struct io_uring_cqe *uring_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+
+#endif
@@ -2,7 +2,8 @@
 
 /*
  * Description: Implementation for xread. Makes sure exactly count bytes
- were read (except in case of I/O or EOF).
+ were read (except in case of I/O or EOF). Interrupted reads are retried;
+ on a non-blocking fd, what was read before EAGAIN is returned.
  */
 ssize_t xread(int fd, void *buf, size_t count)
 {
@@ -15,6 +16,12 @@ ssize_t xread(int fd, void *buf, size_t count)
 		if (bytes_read_now == 0) /* EOF */
 			return bytes_read;
 
+		if (bytes_read_now < 0 && errno == EINTR)
+			continue;
+
+		if (bytes_read_now < 0 && errno == EAGAIN && bytes_read > 0)
+			return bytes_read;
+
 		if (bytes_read_now < 0) /* I/O error */
 			return -1;
 
@@ -26,9 +33,12 @@ ssize_t xread(int fd, void *buf, size_t count)
 
 /*
  * Description: Implementation for write. Makes sure exactly count bytes
- are written (except for I/O error).
+ are written (except for I/O error). Interrupted writes are retried; on a
+ non-blocking fd, what was written before EAGAIN is returned (-1 with
+ errno EAGAIN if nothing was). If calls is not NULL, the number of write
+ calls issued is added to it.
  */
-ssize_t xwrite(int fd, const void *buf, size_t count)
+ssize_t xwrite(int fd, const void *buf, size_t count, unsigned int *calls)
 {
 	size_t bytes_written = 0;
 
@@ -36,6 +46,16 @@ ssize_t xwrite(int fd, const void *buf, size_t count)
 		ssize_t bytes_written_now = write(fd, buf + bytes_written,
 										  count - bytes_written);
 
+		if (calls != NULL)
+			(*calls)++;
+
+		if (bytes_written_now < 0 && errno == EINTR)
+			continue;
+
+		if (bytes_written_now < 0 && errno == EAGAIN &&
+		    bytes_written > 0)
+			return bytes_written;
+
 		if (bytes_written_now <= 0) /* I/O error */
 			return -1;
 
@@ -44,3 +64,14 @@ ssize_t xwrite(int fd, const void *buf, size_t count)
 
 	return bytes_written;
 }
+
+/*
+ * Description: monotonic clock reading, in nanoseconds.
+ */
+unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -1,10 +1,15 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -23,6 +28,7 @@
 	} while (0)
 
 ssize_t xread(int fd, void *buf, size_t count);
-ssize_t xwrite(int fd, const void *buf, size_t count);
+ssize_t xwrite(int fd, const void *buf, size_t count, unsigned int *calls);
+unsigned long long now_ns(void);
 
 #endif